@@ -0,0 +1,991 @@
+#include "bsp_ice40.h"
+#include "bsp_tasks.h"
+#include "hardware.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <driver/gpio.h>
+#include <driver/spi_master.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <hal/gpio_ll.h>
+#include <mbedtls/sha256.h>
+#include <soc/gpio_reg.h>
+#include <soc/gpio_struct.h>
+
+static const char* TAG = "bsp_ice40";
+
+// Clocks sent after the bitstream, the FPGA needs at least 49 to start up.
+#define ICE40_STARTUP_BYTES 13
+
+// Largest bulk transaction, a multiple of 4 so DMA can read into the caller's buffer.
+#define ICE40_BULK_CHUNK_SIZE (SPI_MAX_TRANSFER_SIZE & ~3)
+
+// The mailbox waits 10 ms, doubling every round, while the FPGA holds its interrupt low without
+// responses, and pauses after this many rounds until the next request.
+#define ICE40_MAILBOX_BACKOFF_MS     10
+#define ICE40_MAILBOX_BACKOFF_ROUNDS 8
+
+typedef enum {
+    DEVICE_NONE,
+    DEVICE_LOAD,    // Half duplex at BSP_ICE40_LOAD_SPEED
+    DEVICE_WRITE,   // Half duplex at the turbo speed, MISO is not sampled
+    DEVICE_READ,    // Half duplex at the half duplex speed, also used to post mailbox requests
+    DEVICE_DUPLEX,  // Full duplex at the full duplex speed
+} device_mode_t;
+
+// Loads and bulk transfers share one device without hardware CS: the FPGA only enters SPI
+// slave configuration mode if CS is already low when it leaves reset, and bulk transfers
+// hold CS low across several transactions. The bus has few device slots, so the device is
+// added again when another mode is needed. Only use it while holding device_mutex.
+static spi_device_handle_t device            = NULL;
+static device_mode_t       device_mode       = DEVICE_NONE;
+static SemaphoreHandle_t   device_mutex      = NULL;
+static portMUX_TYPE        device_mutex_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Requests posted to the FPGA that wait for a response.
+typedef struct {
+    bool                   in_use;
+    uint8_t                tag;
+    bsp_ice40_mailbox_cb_t callback;
+    void*                  ctx;
+    int64_t                deadline;  // esp_timer_get_time() after which the request times out, 0 for never.
+} mailbox_slot_t;
+
+static mailbox_slot_t         mailbox_slots[BSP_ICE40_MAILBOX_SLOTS] = {0};
+static uint8_t                mailbox_tag                            = 0;
+static portMUX_TYPE           mailbox_lock                           = portMUX_INITIALIZER_UNLOCKED;
+static bool                   mailbox_started                        = false;
+static bool                   mailbox_paused                         = false;  // The interrupt seems stuck, ignore it.
+static TaskHandle_t           mailbox_task                           = NULL;
+static bsp_ice40_mailbox_cb_t mailbox_handler                        = NULL;
+static void*                  mailbox_handler_ctx                    = NULL;
+
+// Waits for bsp_ice40_mailbox_request().
+typedef struct {
+    SemaphoreHandle_t done;
+    esp_err_t         result;
+    uint8_t*          response;
+    size_t            size;
+    size_t*           length;
+} mailbox_waiter_t;
+
+// Bulk transfers wait here for the bulk task.
+static QueueHandle_t          bulk_queue      = NULL;
+static bsp_ice40_bulk_stats_t bulk_stats      = {0};
+static portMUX_TYPE           bulk_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// SHA-256 of the bitstream the FPGA runs, only trusted while it indicates done.
+static uint8_t loaded_sha256[32];
+static bool    loaded_valid = false;
+
+// Header of compressed bitstreams, all fields little endian.
+#define ICE40_COMPRESSED_VERSION     1
+#define ICE40_COMPRESSED_HEADER_SIZE 44
+
+typedef struct {
+    bsp_ice40_read_t       read;          // Source of the compressed data.
+    void*                  ctx;
+    uint8_t                input[512];
+    size_t                 input_pos;
+    size_t                 input_length;
+    bool                   literal;       // Whether the current token copies input, otherwise it repeats `value`.
+    uint8_t                value;
+    uint32_t               count;         // Bytes left of the current token.
+    uint32_t               remaining;     // Bytes left of the bitstream.
+} decompressor_t;
+
+typedef struct {
+    const esp_partition_t* partition;
+    size_t                 offset;
+    size_t                 remaining;
+} partition_reader_t;
+
+static bool _device_lock() {
+    if (!device_mutex) {
+        SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+        if (!mutex) return false;
+        portENTER_CRITICAL(&device_mutex_lock);
+        if (!device_mutex) {
+            device_mutex = mutex;
+            mutex        = NULL;
+        }
+        portEXIT_CRITICAL(&device_mutex_lock);
+        if (mutex) vSemaphoreDelete(mutex);
+    }
+    return xSemaphoreTake(device_mutex, portMAX_DELAY) == pdTRUE;
+}
+
+static void _device_unlock() {
+    xSemaphoreGive(device_mutex);
+}
+
+// Routing of the CS pin while the ICE40 driver has it.
+static uint32_t cs_out_sel = 0;
+
+// Takes the CS pin from the ICE40 driver's SPI device and drives it high as a plain GPIO.
+// Call while holding the bus, so no driver transaction uses the pin in the meantime.
+static esp_err_t _cs_claim() {
+    cs_out_sel = REG_READ(GPIO_FUNC0_OUT_SEL_CFG_REG + GPIO_SPI_CS_FPGA * 4);
+    // Set the level first so the pin does not glitch low when it switches over.
+    gpio_set_level(GPIO_SPI_CS_FPGA, 1);
+    return gpio_set_direction(GPIO_SPI_CS_FPGA, GPIO_MODE_OUTPUT);
+}
+
+// Hands the CS pin back to the ICE40 driver, call before releasing the bus.
+static void _cs_release() {
+    gpio_set_level(GPIO_SPI_CS_FPGA, 1);
+    REG_WRITE(GPIO_FUNC0_OUT_SEL_CFG_REG + GPIO_SPI_CS_FPGA * 4, cs_out_sel);
+}
+
+// Makes `device` run in `mode`, call while holding device_mutex.
+static esp_err_t _device_set_mode(ICE40* ice40, device_mode_t mode) {
+    if (device && device_mode == mode) return ESP_OK;
+    esp_err_t res;
+    if (device) {
+        res = spi_bus_remove_device(device);
+        if (res != ESP_OK) return res;
+        device      = NULL;
+        device_mode = DEVICE_NONE;
+    }
+
+    spi_device_interface_config_t config = {
+        .mode         = 0,
+        .spics_io_num = -1,
+        .flags        = SPI_DEVICE_HALFDUPLEX,
+        .queue_size   = BSP_ICE40_BULK_DEPTH,
+    };
+    switch (mode) {
+        case DEVICE_LOAD:
+            config.clock_speed_hz = BSP_ICE40_LOAD_SPEED;
+            break;
+        case DEVICE_WRITE:
+            config.clock_speed_hz = ice40->spi_speed_turbo;
+            break;
+        case DEVICE_READ:
+            config.clock_speed_hz = ice40->spi_speed_half_duplex;
+            config.input_delay_ns = ice40->spi_input_delay_ns;
+            break;
+        case DEVICE_DUPLEX:
+            config.clock_speed_hz = ice40->spi_speed_full_duplex;
+            config.input_delay_ns = ice40->spi_input_delay_ns;
+            config.flags          = 0;
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+    res = spi_bus_add_device(SPI_BUS, &config, &device);
+    if (res == ESP_OK) device_mode = mode;
+    return res;
+}
+
+static esp_err_t _send(const uint8_t* data, size_t length) {
+    spi_transaction_t transaction = {
+        .length    = length * 8,
+        .tx_buffer = data,
+    };
+    return spi_device_polling_transmit(device, &transaction);
+}
+
+static esp_err_t _read_file(void* ctx, uint8_t* buffer, size_t size, size_t* length) {
+    FILE* file = (FILE*) ctx;
+    *length    = fread(buffer, 1, size, file);
+    return ferror(file) ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t _read_partition(void* ctx, uint8_t* buffer, size_t size, size_t* length) {
+    partition_reader_t* reader = (partition_reader_t*) ctx;
+    *length = size < reader->remaining ? size : reader->remaining;
+    if (!*length) return ESP_OK;
+    esp_err_t res = esp_partition_read(reader->partition, reader->offset, buffer, *length);
+    reader->offset    += *length;
+    reader->remaining -= *length;
+    return res;
+}
+
+// Reads exactly `length` bytes, or fails with ESP_ERR_INVALID_SIZE at the end of the stream.
+static esp_err_t _read_exact(bsp_ice40_read_t read, void* ctx, uint8_t* buffer, size_t length) {
+    while (length) {
+        size_t    part = 0;
+        esp_err_t res  = read(ctx, buffer, length, &part);
+        if (res != ESP_OK) return res;
+        if (!part) return ESP_ERR_INVALID_SIZE;
+        buffer += part;
+        length -= part;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _fill_input(decompressor_t* decompressor) {
+    if (decompressor->input_pos < decompressor->input_length) return ESP_OK;
+    decompressor->input_pos    = 0;
+    decompressor->input_length = 0;
+    esp_err_t res = decompressor->read(decompressor->ctx, decompressor->input, sizeof(decompressor->input), &decompressor->input_length);
+    if (res == ESP_OK && !decompressor->input_length) res = ESP_ERR_INVALID_SIZE;
+    return res;
+}
+
+static esp_err_t _input_byte(decompressor_t* decompressor, uint8_t* value) {
+    esp_err_t res = _fill_input(decompressor);
+    if (res != ESP_OK) return res;
+    *value = decompressor->input[decompressor->input_pos++];
+    return ESP_OK;
+}
+
+// Reader that decompresses into the DMA buffers.
+static esp_err_t _read_compressed(void* ctx, uint8_t* buffer, size_t size, size_t* length) {
+    decompressor_t* decompressor = (decompressor_t*) ctx;
+    esp_err_t       res          = ESP_OK;
+    size_t          out          = 0;
+    if (size > decompressor->remaining) size = decompressor->remaining;
+
+    while (out < size) {
+        if (!decompressor->count) {
+            uint8_t token, next;
+            res = _input_byte(decompressor, &token);
+            if (res != ESP_OK) break;
+            decompressor->literal = token < 0x80;
+            if (decompressor->literal) {
+                decompressor->count = token + 1;
+            } else {
+                res = _input_byte(decompressor, &next);
+                if (res != ESP_OK) break;
+                if (token < 0xC0) {
+                    decompressor->value = 0;
+                    decompressor->count = (((token & 0x3F) << 8) | next) + 1;
+                } else {
+                    decompressor->value = next;
+                    decompressor->count = (token & 0x3F) + 3;
+                }
+            }
+        }
+
+        size_t part = size - out < decompressor->count ? size - out : decompressor->count;
+        if (decompressor->literal) {
+            res = _fill_input(decompressor);
+            if (res != ESP_OK) break;
+            size_t available = decompressor->input_length - decompressor->input_pos;
+            if (part > available) part = available;
+            memcpy(&buffer[out], &decompressor->input[decompressor->input_pos], part);
+            decompressor->input_pos += part;
+        } else {
+            memset(&buffer[out], decompressor->value, part);
+        }
+        out                 += part;
+        decompressor->count -= part;
+    }
+
+    decompressor->remaining -= out;
+    *length = out;
+    return res;
+}
+
+// Sends the bitstream, reading the next chunk into one buffer while the other is transmitted.
+static esp_err_t _stream(bsp_ice40_read_t read, void* ctx, uint8_t* buffers[2], uint32_t* total, mbedtls_sha256_context* sha256_ctx) {
+    spi_transaction_t  transactions[2];
+    spi_transaction_t* finished;
+    bool               in_flight[2] = {false, false};
+    esp_err_t          res          = ESP_OK;
+
+    for (int current = 0;; current ^= 1) {
+        // Transactions finish in order, so the older one is the one that used this buffer.
+        if (in_flight[current]) {
+            res = spi_device_get_trans_result(device, &finished, portMAX_DELAY);
+            if (res != ESP_OK) break;
+            in_flight[current] = false;
+        }
+
+        size_t length = 0;
+        res = read(ctx, buffers[current], BSP_ICE40_CHUNK_SIZE, &length);
+        if (res != ESP_OK || !length) break;
+        mbedtls_sha256_update_ret(sha256_ctx, buffers[current], length);
+
+        memset(&transactions[current], 0, sizeof(spi_transaction_t));
+        transactions[current].length    = length * 8;
+        transactions[current].tx_buffer = buffers[current];
+        res = spi_device_queue_trans(device, &transactions[current], portMAX_DELAY);
+        if (res != ESP_OK) break;
+        in_flight[current] = true;
+        *total += length;
+    }
+
+    // Always collect what is still queued, the buffers are freed afterwards.
+    for (int i = 0; i < 2; i++) {
+        if (in_flight[i]) spi_device_get_trans_result(device, &finished, portMAX_DELAY);
+    }
+    return res;
+}
+
+// Whether the FPGA still runs the bitstream loaded last, forgets it if not.
+static bool _loaded_is_valid(ICE40* ice40) {
+    if (!loaded_valid) return false;
+    bool done = false;
+    if (ice40_get_done(ice40, &done) != ESP_OK || !done) loaded_valid = false;
+    return loaded_valid;
+}
+
+// Loads a bitstream, or skips it if asked to and the FPGA runs it already.
+// `sha256` is the expected hash, or NULL if unknown.
+static esp_err_t _load(bsp_ice40_read_t read, void* ctx, const uint8_t* sha256, bool skip_loaded) {
+    ICE40* ice40 = get_ice40();
+    if (!ice40) return ESP_ERR_INVALID_STATE;
+
+    if (skip_loaded && sha256 && _loaded_is_valid(ice40) && !memcmp(sha256, loaded_sha256, sizeof(loaded_sha256))) {
+        ESP_LOGI(TAG, "Bitstream is loaded already");
+        return ESP_OK;
+    }
+
+    uint8_t* buffers[2];
+    buffers[0] = heap_caps_malloc(BSP_ICE40_CHUNK_SIZE, MALLOC_CAP_DMA);
+    buffers[1] = heap_caps_malloc(BSP_ICE40_CHUNK_SIZE, MALLOC_CAP_DMA);
+    if (!buffers[0] || !buffers[1]) {
+        heap_caps_free(buffers[0]);
+        heap_caps_free(buffers[1]);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Bulk transfers wait until the load is done.
+    esp_err_t res = ESP_ERR_NO_MEM;
+    if (!_device_lock()) goto cleanup;
+    res = _device_set_mode(ice40, DEVICE_LOAD);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Adding SPI device for loading failed");
+        goto unlock;
+    }
+
+    // Keep the display off the bus for the whole load.
+    res = spi_device_acquire_bus(device, portMAX_DELAY);
+    if (res != ESP_OK) goto unlock;
+
+    int64_t  start = esp_timer_get_time();
+    uint32_t total = 0;
+    uint8_t  computed[32];
+    mbedtls_sha256_context sha256_ctx;
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_starts_ret(&sha256_ctx, 0);
+
+    res = _cs_claim();
+    if (res != ESP_OK) goto release;
+
+    // Resetting the FPGA throws away whatever it was running.
+    loaded_valid = false;
+
+    // Reset into SPI slave configuration mode, the reset callback waits long enough for
+    // the FPGA to clear its configuration memory.
+    res = ice40->set_reset(false);
+    if (res != ESP_OK) goto release;
+    gpio_set_level(GPIO_SPI_CS_FPGA, 0);
+    res = ice40->set_reset(true);
+    if (res != ESP_OK) goto release;
+
+    // Eight clocks with CS high before the bitstream.
+    memset(buffers[0], 0, ICE40_STARTUP_BYTES);
+    gpio_set_level(GPIO_SPI_CS_FPGA, 1);
+    res = _send(buffers[0], 1);
+    gpio_set_level(GPIO_SPI_CS_FPGA, 0);
+    if (res != ESP_OK) goto release;
+
+    res = _stream(read, ctx, buffers, &total, &sha256_ctx);
+    gpio_set_level(GPIO_SPI_CS_FPGA, 1);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Streaming bitstream failed: %s", esp_err_to_name(res));
+        goto release;
+    }
+    mbedtls_sha256_finish_ret(&sha256_ctx, computed);
+    if (sha256 && memcmp(computed, sha256, sizeof(computed))) {
+        // The FPGA has the data already and may start it, keep it in reset instead.
+        ESP_LOGE(TAG, "Bitstream does not match its hash");
+        ice40->set_reset(false);
+        res = ESP_ERR_INVALID_CRC;
+        goto release;
+    }
+
+    // Clock the FPGA into user mode.
+    memset(buffers[0], 0, ICE40_STARTUP_BYTES);
+    res = _send(buffers[0], ICE40_STARTUP_BYTES);
+    if (res != ESP_OK) goto release;
+
+    bool done = false;
+    res = ice40_get_done(ice40, &done);
+    if (res == ESP_OK && !done) {
+        ESP_LOGE(TAG, "ICE40 does not indicate done after loading %u bytes", total);
+        res = ESP_FAIL;
+    }
+
+    uint32_t duration_us = esp_timer_get_time() - start;
+    if (res == ESP_OK) {
+        memcpy(loaded_sha256, computed, sizeof(loaded_sha256));
+        loaded_valid = true;
+        ESP_LOGI(TAG, "Loaded %u bytes in %u ms (%u KiB/s)", total, duration_us / 1000,
+                 duration_us ? (uint32_t) ((uint64_t) total * 1000000 / 1024 / duration_us) : 0);
+    }
+
+    release:
+    mbedtls_sha256_free(&sha256_ctx);
+    _cs_release();
+    spi_device_release_bus(device);
+    unlock:
+    _device_unlock();
+    cleanup:
+    heap_caps_free(buffers[0]);
+    heap_caps_free(buffers[1]);
+    return res;
+}
+
+// Hashes a raw bitstream ahead of loading it, to find out whether it is loaded already.
+// Only worth the extra read if the FPGA runs a known bitstream.
+static bool _hash(bsp_ice40_read_t read, void* ctx, uint8_t* sha256) {
+    ICE40* ice40 = get_ice40();
+    if (!ice40 || !_loaded_is_valid(ice40)) return false;
+    uint8_t* buffer = malloc(BSP_ICE40_CHUNK_SIZE);
+    if (!buffer) return false;
+    mbedtls_sha256_context sha256_ctx;
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_starts_ret(&sha256_ctx, 0);
+    esp_err_t res;
+    size_t    length;
+    while ((res = read(ctx, buffer, BSP_ICE40_CHUNK_SIZE, &length)) == ESP_OK && length) {
+        mbedtls_sha256_update_ret(&sha256_ctx, buffer, length);
+    }
+    mbedtls_sha256_finish_ret(&sha256_ctx, sha256);
+    mbedtls_sha256_free(&sha256_ctx);
+    free(buffer);
+    return res == ESP_OK;
+}
+
+esp_err_t bsp_ice40_load_stream(bsp_ice40_read_t read, void* ctx) {
+    return _load(read, ctx, NULL, false);
+}
+
+bool bsp_ice40_is_loaded(const uint8_t* sha256) {
+    ICE40* ice40 = get_ice40();
+    if (!ice40 || !sha256 || !_loaded_is_valid(ice40)) return false;
+    return !memcmp(sha256, loaded_sha256, sizeof(loaded_sha256));
+}
+
+void bsp_ice40_forget_loaded() {
+    loaded_valid = false;
+}
+
+esp_err_t bsp_ice40_load_compressed_stream(bsp_ice40_read_t read, void* ctx, bool skip_loaded) {
+    uint8_t   header[ICE40_COMPRESSED_HEADER_SIZE];
+    esp_err_t res = _read_exact(read, ctx, header, sizeof(header));
+    if (res != ESP_OK) return res;
+    if (memcmp(header, BSP_ICE40_COMPRESSED_MAGIC, 4) || header[4] != ICE40_COMPRESSED_VERSION) {
+        ESP_LOGE(TAG, "Not a compressed bitstream");
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    decompressor_t* decompressor = calloc(1, sizeof(decompressor_t));
+    if (!decompressor) return ESP_ERR_NO_MEM;
+    decompressor->read      = read;
+    decompressor->ctx       = ctx;
+    decompressor->remaining = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t) header[11] << 24);
+
+    // The header has the hash, so an identical bitstream is skipped before decompressing anything.
+    res = _load(_read_compressed, decompressor, &header[12], skip_loaded);
+    free(decompressor);
+    return res;
+}
+
+esp_err_t bsp_ice40_load_file(FILE* file, bool skip_loaded) {
+    if (!file) return ESP_ERR_INVALID_ARG;
+    // Peek at the magic number.
+    char magic[4] = {0};
+    long start    = ftell(file);
+    fread(magic, 1, sizeof(magic), file);
+    if (fseek(file, start, SEEK_SET) != 0) return ESP_FAIL;
+    if (!memcmp(magic, BSP_ICE40_COMPRESSED_MAGIC, sizeof(magic))) return bsp_ice40_load_compressed_stream(_read_file, file, skip_loaded);
+
+    uint8_t sha256[32];
+    bool    hashed = skip_loaded && _hash(_read_file, file, sha256);
+    if (fseek(file, start, SEEK_SET) != 0) return ESP_FAIL;
+    return _load(_read_file, file, hashed ? sha256 : NULL, skip_loaded);
+}
+
+esp_err_t bsp_ice40_load_partition(const esp_partition_t* partition, size_t offset, size_t length, bool skip_loaded) {
+    if (!partition || offset > partition->size || length > partition->size - offset) return ESP_ERR_INVALID_ARG;
+    partition_reader_t reader = {
+        .partition = partition,
+        .offset    = offset,
+        .remaining = length,
+    };
+    char magic[4] = {0};
+    if (length >= sizeof(magic)) {
+        esp_err_t res = esp_partition_read(partition, offset, magic, sizeof(magic));
+        if (res != ESP_OK) return res;
+    }
+    if (!memcmp(magic, BSP_ICE40_COMPRESSED_MAGIC, sizeof(magic))) return bsp_ice40_load_compressed_stream(_read_partition, &reader, skip_loaded);
+
+    uint8_t            sha256[32];
+    partition_reader_t hash_reader = reader;
+    bool               hashed      = skip_loaded && _hash(_read_partition, &hash_reader, sha256);
+    return _load(_read_partition, &reader, hashed ? sha256 : NULL, skip_loaded);
+}
+
+// Takes the bus for a transfer to the FPGA logic in `mode` and pulls CS low.
+static esp_err_t _select(device_mode_t mode) {
+    ICE40* ice40 = get_ice40();
+    if (!ice40) return ESP_ERR_INVALID_STATE;
+    if (!_device_lock()) return ESP_ERR_NO_MEM;
+    esp_err_t res = _device_set_mode(ice40, mode);
+    if (res == ESP_OK) res = spi_device_acquire_bus(device, portMAX_DELAY);
+    if (res != ESP_OK) {
+        _device_unlock();
+        return res;
+    }
+    res = _cs_claim();
+    if (res != ESP_OK) {
+        _cs_release();
+        spi_device_release_bus(device);
+        _device_unlock();
+        return res;
+    }
+    gpio_set_level(GPIO_SPI_CS_FPGA, 0);
+    return ESP_OK;
+}
+
+static void _deselect() {
+    _cs_release();
+    spi_device_release_bus(device);
+    _device_unlock();
+}
+
+static esp_err_t _send_command(uint8_t command) {
+    spi_transaction_t transaction = {
+        .flags   = SPI_TRANS_USE_TXDATA,
+        .length  = 8,
+        .tx_data = {command},
+    };
+    return spi_device_polling_transmit(device, &transaction);
+}
+
+// Runs one bulk transfer with CS held low, keeping up to BSP_ICE40_BULK_DEPTH transactions queued.
+static esp_err_t _bulk_run(bsp_ice40_bulk_t* transfer) {
+    device_mode_t mode = transfer->tx && transfer->rx ? DEVICE_DUPLEX : (transfer->rx ? DEVICE_READ : DEVICE_WRITE);
+
+    esp_err_t res = _select(mode);
+    if (res != ESP_OK) return res;
+
+    int64_t start = esp_timer_get_time();
+    res = _send_command(transfer->command);
+
+    spi_transaction_t  transactions[BSP_ICE40_BULK_DEPTH];
+    spi_transaction_t* finished;
+    size_t             queued = 0;
+    size_t             done   = 0;
+    size_t             offset = 0;
+    while (res == ESP_OK && offset < transfer->length) {
+        // Keep the queue full so the next transaction starts as soon as one finishes.
+        if (queued - done == BSP_ICE40_BULK_DEPTH) {
+            res = spi_device_get_trans_result(device, &finished, portMAX_DELAY);
+            if (res != ESP_OK) break;
+            done++;
+        }
+        size_t             length      = transfer->length - offset < ICE40_BULK_CHUNK_SIZE ? transfer->length - offset : ICE40_BULK_CHUNK_SIZE;
+        spi_transaction_t* transaction = &transactions[queued % BSP_ICE40_BULK_DEPTH];
+        memset(transaction, 0, sizeof(spi_transaction_t));
+        if (transfer->tx) {
+            transaction->length    = length * 8;
+            transaction->tx_buffer = (const uint8_t*) transfer->tx + offset;
+        }
+        if (transfer->rx) {
+            transaction->rxlength  = length * 8;
+            transaction->rx_buffer = (uint8_t*) transfer->rx + offset;
+        }
+        res = spi_device_queue_trans(device, transaction, portMAX_DELAY);
+        if (res != ESP_OK) break;
+        queued++;
+        offset += length;
+    }
+
+    // Always collect what is still queued, the caller may reuse its buffers afterwards.
+    while (done < queued) {
+        esp_err_t result = spi_device_get_trans_result(device, &finished, portMAX_DELAY);
+        if (result != ESP_OK) {
+            if (res == ESP_OK) res = result;
+            break;
+        }
+        done++;
+    }
+
+    int64_t duration_us = esp_timer_get_time() - start;
+    _deselect();
+
+    if (res == ESP_OK) {
+        portENTER_CRITICAL(&bulk_stats_lock);
+        bulk_stats.transfers++;
+        if (transfer->tx) bulk_stats.bytes_written += transfer->length;
+        if (transfer->rx) bulk_stats.bytes_read += transfer->length;
+        bulk_stats.busy_us += duration_us;
+        portEXIT_CRITICAL(&bulk_stats_lock);
+    }
+    return res;
+}
+
+static void _bulk_task(void* arg) {
+    bsp_ice40_bulk_t* transfer;
+    while (1) {
+        if (xQueueReceive(bulk_queue, &transfer, portMAX_DELAY) != pdTRUE) continue;
+        transfer->result = _bulk_run(transfer);
+        if (transfer->result != ESP_OK) ESP_LOGE(TAG, "Bulk transfer failed: %s", esp_err_to_name(transfer->result));
+        if (transfer->callback) transfer->callback(transfer);
+    }
+}
+
+static esp_err_t _bulk_start() {
+    if (bulk_queue) return ESP_OK;
+    if (!_device_lock()) return ESP_ERR_NO_MEM;
+    esp_err_t res = ESP_OK;
+    if (!bulk_queue) {
+        QueueHandle_t queue = xQueueCreate(BSP_ICE40_BULK_QUEUE_LENGTH, sizeof(bsp_ice40_bulk_t*));
+        if (!queue) {
+            res = ESP_ERR_NO_MEM;
+        } else {
+            bulk_queue = queue;
+            if (bsp_task_create(BSP_TASK_ICE40_BULK, _bulk_task, NULL) != pdPASS) {
+                ESP_LOGE(TAG, "Failed to create bulk transfer task");
+                bulk_queue = NULL;
+                vQueueDelete(queue);
+                res = ESP_ERR_NO_MEM;
+            }
+        }
+    }
+    _device_unlock();
+    return res;
+}
+
+esp_err_t bsp_ice40_bulk_queue(bsp_ice40_bulk_t* transfer) {
+    if (!transfer || (!transfer->tx && !transfer->rx)) return ESP_ERR_INVALID_ARG;
+    if (!get_ice40()) return ESP_ERR_INVALID_STATE;
+    esp_err_t res = _bulk_start();
+    if (res != ESP_OK) return res;
+    if (xQueueSend(bulk_queue, &transfer, portMAX_DELAY) != pdTRUE) return ESP_FAIL;
+    return ESP_OK;
+}
+
+static void _bulk_done(bsp_ice40_bulk_t* transfer) {
+    xSemaphoreGive((SemaphoreHandle_t) transfer->ctx);
+}
+
+esp_err_t bsp_ice40_bulk_transfer(bsp_ice40_bulk_t* transfer) {
+    if (!transfer) return ESP_ERR_INVALID_ARG;
+    SemaphoreHandle_t finished = xSemaphoreCreateBinary();
+    if (!finished) return ESP_ERR_NO_MEM;
+    transfer->callback = _bulk_done;
+    transfer->ctx      = finished;
+    esp_err_t res      = bsp_ice40_bulk_queue(transfer);
+    if (res == ESP_OK) {
+        xSemaphoreTake(finished, portMAX_DELAY);
+        res = transfer->result;
+    }
+    vSemaphoreDelete(finished);
+    return res;
+}
+
+void bsp_ice40_bulk_get_stats(bsp_ice40_bulk_stats_t* stats) {
+    if (!stats) return;
+    portENTER_CRITICAL(&bulk_stats_lock);
+    *stats = bulk_stats;
+    portEXIT_CRITICAL(&bulk_stats_lock);
+    stats->throughput_kbps = stats->busy_us ? (uint32_t) ((stats->bytes_written + stats->bytes_read) * 8000 / stats->busy_us) : 0;
+}
+
+void bsp_ice40_bulk_reset_stats() {
+    portENTER_CRITICAL(&bulk_stats_lock);
+    memset(&bulk_stats, 0, sizeof(bulk_stats));
+    portEXIT_CRITICAL(&bulk_stats_lock);
+}
+
+// `arg` is the mailbox task, which can get the interrupt before _mailbox_start sets mailbox_task.
+static void IRAM_ATTR _mailbox_isr(void* arg) {
+    BaseType_t woken = pdFALSE;
+    // The interrupt is level triggered, the task enables it again once the FPGA has nothing left.
+    // The GPIO ISR service isn't IRAM safe, so this only runs with the flash cache enabled.
+    // The HAL call is inlined, which keeps the handler short.
+    gpio_ll_intr_disable(&GPIO, GPIO_INT_FPGA);
+    vTaskNotifyGiveFromISR((TaskHandle_t) arg, &woken);
+    if (woken) portYIELD_FROM_ISR();
+}
+
+// Takes the slot of a request out of the table, false if it is not waiting (anymore).
+static bool _mailbox_take(uint8_t tag, mailbox_slot_t* slot) {
+    bool found = false;
+    portENTER_CRITICAL(&mailbox_lock);
+    for (int i = 0; i < BSP_ICE40_MAILBOX_SLOTS; i++) {
+        if (mailbox_slots[i].in_use && mailbox_slots[i].tag == tag) {
+            *slot                   = mailbox_slots[i];
+            mailbox_slots[i].in_use = false;
+            found                   = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&mailbox_lock);
+    return found;
+}
+
+// Reads one response from the FPGA and hands it to whoever waits for it, returns whether it did.
+static bool _mailbox_fetch(uint8_t* response) {
+    esp_err_t res = _select(DEVICE_READ);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Mailbox cannot use the bus: %s", esp_err_to_name(res));
+        return false;
+    }
+    res = _send_command(BSP_ICE40_MAILBOX_FETCH);
+
+    // Tag and length first, then the payload with CS still low.
+    spi_transaction_t header = {
+        .flags    = SPI_TRANS_USE_RXDATA,
+        .rxlength = 16,
+    };
+    if (res == ESP_OK) res = spi_device_polling_transmit(device, &header);
+    uint8_t tag    = header.rx_data[0];
+    size_t  length = header.rx_data[1];
+    if (res == ESP_OK && length > BSP_ICE40_MAILBOX_SIZE) res = ESP_ERR_INVALID_SIZE;
+    if (res == ESP_OK && length) {
+        spi_transaction_t payload = {
+            .rxlength  = length * 8,
+            .rx_buffer = response,
+        };
+        res = spi_device_polling_transmit(device, &payload);
+    }
+    _deselect();
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Fetching mailbox response failed: %s", esp_err_to_name(res));
+        return false;
+    }
+
+    if (!tag) {
+        if (mailbox_handler) mailbox_handler(mailbox_handler_ctx, ESP_OK, response, length);
+        return true;
+    }
+    mailbox_slot_t slot;
+    if (!_mailbox_take(tag, &slot)) {
+        ESP_LOGW(TAG, "Dropped mailbox response for unknown request %u", tag);
+        return false;
+    }
+    if (slot.callback) slot.callback(slot.ctx, ESP_OK, response, length);
+    return true;
+}
+
+// Fails the requests that waited too long, returns whether any requests are still waiting.
+static bool _mailbox_expire() {
+    mailbox_slot_t expired[BSP_ICE40_MAILBOX_SLOTS];
+    size_t         count   = 0;
+    bool           waiting = false;
+    int64_t        now     = esp_timer_get_time();
+    portENTER_CRITICAL(&mailbox_lock);
+    for (int i = 0; i < BSP_ICE40_MAILBOX_SLOTS; i++) {
+        if (!mailbox_slots[i].in_use) continue;
+        if (mailbox_slots[i].deadline && now >= mailbox_slots[i].deadline) {
+            expired[count++]        = mailbox_slots[i];
+            mailbox_slots[i].in_use = false;
+        } else {
+            waiting = true;
+        }
+    }
+    portEXIT_CRITICAL(&mailbox_lock);
+    for (size_t i = 0; i < count; i++) {
+        ESP_LOGW(TAG, "Mailbox request %u timed out", expired[i].tag);
+        if (expired[i].callback) expired[i].callback(expired[i].ctx, ESP_ERR_TIMEOUT, NULL, 0);
+    }
+    return waiting;
+}
+
+static void _mailbox_task(void* arg) {
+    uint8_t response[BSP_ICE40_MAILBOX_SIZE];
+
+    esp_err_t res = gpio_set_direction(GPIO_INT_FPGA, GPIO_MODE_INPUT);
+    if (res == ESP_OK) res = gpio_set_intr_type(GPIO_INT_FPGA, GPIO_INTR_LOW_LEVEL);
+    if (res == ESP_OK) res = gpio_isr_handler_add(GPIO_INT_FPGA, _mailbox_isr, xTaskGetCurrentTaskHandle());
+    if (res == ESP_OK) res = gpio_intr_enable(GPIO_INT_FPGA);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Installing FPGA interrupt handler failed: %s", esp_err_to_name(res));
+        // Wait for _mailbox_start to finish before undoing it.
+        _device_lock();
+        mailbox_started = false;
+        mailbox_task    = NULL;
+        _device_unlock();
+        bsp_task_exit(BSP_TASK_ICE40_MAILBOX);
+        return;
+    }
+
+    // Requests may have been posted before the task first ran, start by checking their timeouts.
+    bool    waiting = true;
+    uint8_t rounds  = 0;  // Rounds in a row the interrupt stayed low without responses.
+    while (1) {
+        // Only wake up on a timer while a request can time out.
+        ulTaskNotifyTake(pdTRUE, waiting ? pdMS_TO_TICKS(10) : portMAX_DELAY);
+        portENTER_CRITICAL(&mailbox_lock);
+        bool paused = mailbox_paused;
+        portEXIT_CRITICAL(&mailbox_lock);
+        if (paused) {
+            waiting = _mailbox_expire();
+            rounds  = 0;
+            continue;
+        }
+
+        // The FPGA keeps the interrupt low for as long as it has responses.
+        bool delivered = false;
+        for (int i = 0; i <= BSP_ICE40_MAILBOX_SLOTS && !gpio_get_level(GPIO_INT_FPGA); i++) {
+            delivered |= _mailbox_fetch(response);
+        }
+        waiting = _mailbox_expire();
+        if (delivered || gpio_get_level(GPIO_INT_FPGA)) {
+            rounds = 0;
+            gpio_intr_enable(GPIO_INT_FPGA);
+            continue;
+        }
+
+        // The line stays low without responses, e.g. when the bitstream has no mailbox.
+        if (++rounds >= ICE40_MAILBOX_BACKOFF_ROUNDS) {
+            ESP_LOGE(TAG, "FPGA interrupt stays low, ignoring it until the next mailbox request");
+            portENTER_CRITICAL(&mailbox_lock);
+            mailbox_paused = true;
+            portEXIT_CRITICAL(&mailbox_lock);
+            continue;
+        }
+        vTaskDelay(pdMS_TO_TICKS(ICE40_MAILBOX_BACKOFF_MS << rounds));
+        gpio_intr_enable(GPIO_INT_FPGA);
+    }
+}
+
+// Listens to the interrupt again if the task gave up on it.
+static void _mailbox_resume() {
+    portENTER_CRITICAL(&mailbox_lock);
+    bool paused    = mailbox_paused;
+    mailbox_paused = false;
+    portEXIT_CRITICAL(&mailbox_lock);
+    if (paused) xTaskNotifyGive(mailbox_task);
+}
+
+static esp_err_t _mailbox_start() {
+    if (mailbox_started) {
+        _mailbox_resume();
+        return ESP_OK;
+    }
+    if (!get_ice40()) return ESP_ERR_INVALID_STATE;
+    if (!_device_lock()) return ESP_ERR_NO_MEM;
+    esp_err_t res = ESP_OK;
+    if (!mailbox_started) {
+        if (bsp_task_create(BSP_TASK_ICE40_MAILBOX, _mailbox_task, NULL) == pdPASS) {
+            // Known before any request is posted, so posting can always wake the task.
+            mailbox_task    = bsp_task_get_handle(BSP_TASK_ICE40_MAILBOX);
+            mailbox_started = true;
+        } else {
+            ESP_LOGE(TAG, "Failed to create mailbox task");
+            res = ESP_ERR_NO_MEM;
+        }
+    }
+    _device_unlock();
+    return res;
+}
+
+esp_err_t bsp_ice40_mailbox_post(uint8_t command, const void* request, size_t length, uint32_t timeout_ms, bsp_ice40_mailbox_cb_t callback, void* ctx) {
+    if (length > BSP_ICE40_MAILBOX_SIZE || (length && !request)) return ESP_ERR_INVALID_ARG;
+    esp_err_t res = _mailbox_start();
+    if (res != ESP_OK) return res;
+
+    // Claim a slot and a tag no other waiting request uses.
+    uint8_t tag  = 0;
+    int     slot = -1;
+    portENTER_CRITICAL(&mailbox_lock);
+    for (int i = 0; i < BSP_ICE40_MAILBOX_SLOTS; i++) {
+        if (!mailbox_slots[i].in_use) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0) {
+        bool taken;
+        do {
+            tag   = ++mailbox_tag;
+            taken = !tag;
+            for (int i = 0; i < BSP_ICE40_MAILBOX_SLOTS; i++) {
+                if (mailbox_slots[i].in_use && mailbox_slots[i].tag == tag) taken = true;
+            }
+        } while (taken);
+        mailbox_slots[slot].in_use   = true;
+        mailbox_slots[slot].tag      = tag;
+        mailbox_slots[slot].callback = callback;
+        mailbox_slots[slot].ctx      = ctx;
+        mailbox_slots[slot].deadline = timeout_ms ? esp_timer_get_time() + (int64_t) timeout_ms * 1000 : 0;
+    }
+    portEXIT_CRITICAL(&mailbox_lock);
+    if (slot < 0) return ESP_ERR_NO_MEM;
+
+    uint8_t frame[3 + BSP_ICE40_MAILBOX_SIZE];
+    frame[0] = tag;
+    frame[1] = command;
+    frame[2] = length;
+    if (length) memcpy(&frame[3], request, length);
+
+    // The same mode as fetching responses, so a request and its response don't add the device twice.
+    res = _select(DEVICE_READ);
+    if (res == ESP_OK) {
+        res = _send_command(BSP_ICE40_MAILBOX_POST);
+        spi_transaction_t transaction = {
+            .length    = (3 + length) * 8,
+            .tx_buffer = frame,
+        };
+        if (res == ESP_OK) res = spi_device_polling_transmit(device, &transaction);
+        _deselect();
+    }
+    if (res != ESP_OK) {
+        // The FPGA never saw the request, so nothing answers it.
+        mailbox_slot_t unused;
+        _mailbox_take(tag, &unused);
+        ESP_LOGE(TAG, "Posting mailbox request failed: %s", esp_err_to_name(res));
+        return res;
+    }
+
+    // Wake the task so it starts timing out this request.
+    if (timeout_ms && mailbox_task) xTaskNotifyGive(mailbox_task);
+    return ESP_OK;
+}
+
+static void _mailbox_wake(void* ctx, esp_err_t result, const uint8_t* response, size_t length) {
+    mailbox_waiter_t* waiter = (mailbox_waiter_t*) ctx;
+    waiter->result           = result;
+    if (result == ESP_OK && length > waiter->size) {
+        waiter->result = ESP_ERR_INVALID_SIZE;
+    } else if (result == ESP_OK) {
+        if (length) memcpy(waiter->response, response, length);
+        if (waiter->length) *waiter->length = length;
+    }
+    xSemaphoreGive(waiter->done);
+}
+
+esp_err_t bsp_ice40_mailbox_request(uint8_t command, const void* request, size_t length, void* response, size_t response_size, size_t* response_length,
+                                    uint32_t timeout_ms) {
+    if (response_size && !response) return ESP_ERR_INVALID_ARG;
+    if (mailbox_task && xTaskGetCurrentTaskHandle() == mailbox_task) return ESP_ERR_INVALID_STATE;
+    mailbox_waiter_t waiter = {
+        .done     = xSemaphoreCreateBinary(),
+        .result   = ESP_FAIL,
+        .response = response,
+        .size     = response_size,
+        .length   = response_length,
+    };
+    if (!waiter.done) return ESP_ERR_NO_MEM;
+    esp_err_t res = bsp_ice40_mailbox_post(command, request, length, timeout_ms, _mailbox_wake, &waiter);
+    if (res == ESP_OK) {
+        // The mailbox task always calls back, with ESP_ERR_TIMEOUT if the FPGA does not answer.
+        xSemaphoreTake(waiter.done, portMAX_DELAY);
+        res = waiter.result;
+    }
+    vSemaphoreDelete(waiter.done);
+    return res;
+}
+
+esp_err_t bsp_ice40_mailbox_set_handler(bsp_ice40_mailbox_cb_t handler, void* ctx) {
+    portENTER_CRITICAL(&mailbox_lock);
+    mailbox_handler     = handler;
+    mailbox_handler_ctx = ctx;
+    portEXIT_CRITICAL(&mailbox_lock);
+    return handler ? _mailbox_start() : ESP_OK;
+}
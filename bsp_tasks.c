@@ -0,0 +1,90 @@
+#include "bsp_tasks.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sdkconfig.h>
+
+// Radio work stays on BSP_RADIO_CORE, input handling may run on either core but must preempt the UI.
+static bsp_task_config_t task_configs[BSP_TASK_COUNT] = {
+    [BSP_TASK_WIFI]          = {.name = "wifi",          .core = BSP_RADIO_CORE, .priority = 0,  .stack_size = 0},
+    [BSP_TASK_WIFI_EVENTS]   = {.name = "wifi_events",   .core = BSP_RADIO_CORE, .priority = 5,  .stack_size = 3072},
+    [BSP_TASK_WIFI_HEALTH]   = {.name = "wifi_health",   .core = tskNO_AFFINITY, .priority = 2,  .stack_size = 2560},
+    [BSP_TASK_WIFI_CONNECT]  = {.name = "wifi_connect",  .core = BSP_RADIO_CORE, .priority = 3,  .stack_size = 4096},
+    [BSP_TASK_RP2040]        = {.name = "rp2040",        .core = tskNO_AFFINITY, .priority = 12, .stack_size = 0},
+    [BSP_TASK_ICE40_BULK]    = {.name = "ice40_bulk",    .core = tskNO_AFFINITY, .priority = 6,  .stack_size = 3072},
+    [BSP_TASK_ICE40_MAILBOX] = {.name = "ice40_mailbox", .core = tskNO_AFFINITY, .priority = 7,  .stack_size = 3072},
+};
+
+static TaskHandle_t task_handles[BSP_TASK_COUNT] = {0};
+
+const bsp_task_config_t* bsp_task_get_config(bsp_task_id_t task) {
+    if (task >= BSP_TASK_COUNT) return NULL;
+    return &task_configs[task];
+}
+
+esp_err_t bsp_task_set_config(bsp_task_id_t task, const bsp_task_config_t* config) {
+    if (task >= BSP_TASK_COUNT || !config) return ESP_ERR_INVALID_ARG;
+    if (config->priority >= configMAX_PRIORITIES) return ESP_ERR_INVALID_ARG;
+    if (config->core != 0 && config->core != 1 && config->core != tskNO_AFFINITY) return ESP_ERR_INVALID_ARG;
+    const char* name = task_configs[task].name;
+    task_configs[task]      = *config;
+    task_configs[task].name = name;
+    if (task_handles[task] && config->priority) vTaskPrioritySet(task_handles[task], config->priority);
+    return ESP_OK;
+}
+
+BaseType_t bsp_task_create(bsp_task_id_t task, TaskFunction_t function, void* arg) {
+    if (task >= BSP_TASK_COUNT) return pdFAIL;
+    const bsp_task_config_t* config = &task_configs[task];
+    return xTaskCreatePinnedToCore(function, config->name, config->stack_size, arg, config->priority, &task_handles[task], config->core);
+}
+
+TaskHandle_t bsp_task_get_handle(bsp_task_id_t task) {
+    if (task >= BSP_TASK_COUNT) return NULL;
+    return task_handles[task];
+}
+
+void bsp_task_exit(bsp_task_id_t task) {
+    if (task < BSP_TASK_COUNT) task_handles[task] = NULL;
+    vTaskDelete(NULL);
+}
+
+void bsp_task_adopt(bsp_task_id_t task, TaskHandle_t handle) {
+    if (task >= BSP_TASK_COUNT || !handle) return;
+    task_handles[task] = handle;
+    if (task_configs[task].priority) vTaskPrioritySet(handle, task_configs[task].priority);
+}
+
+void bsp_task_forget(bsp_task_id_t task) {
+    if (task < BSP_TASK_COUNT) task_handles[task] = NULL;
+}
+
+size_t bsp_task_get_stats(bsp_task_stats_t* stats, size_t max_stats) {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    UBaseType_t   max_tasks = uxTaskGetNumberOfTasks() + 4;
+    TaskStatus_t* tasks     = calloc(max_tasks, sizeof(TaskStatus_t));
+    if (!tasks) return 0;
+    uint32_t    total_run_time = 0;
+    UBaseType_t num_tasks      = uxTaskGetSystemState(tasks, max_tasks, &total_run_time);
+    
+    size_t count = 0;
+    for (UBaseType_t i = 0; i < num_tasks && count < max_stats; i++, count++) {
+        bsp_task_stats_t* stat = &stats[count];
+        strncpy(stat->name, tasks[i].pcTaskName, sizeof(stat->name) - 1);
+        stat->name[sizeof(stat->name) - 1] = 0;
+        stat->bsp_task = -1;
+        for (int j = 0; j < BSP_TASK_COUNT; j++) {
+            if (task_handles[j] == tasks[i].xHandle) stat->bsp_task = j;
+        }
+        stat->core        = xTaskGetAffinity(tasks[i].xHandle);
+        stat->priority    = tasks[i].uxCurrentPriority;
+        stat->stack_free  = tasks[i].usStackHighWaterMark;
+        stat->run_time    = tasks[i].ulRunTimeCounter;
+        stat->cpu_percent = total_run_time >= 100 ? tasks[i].ulRunTimeCounter / (total_run_time / 100) : 0;
+    }
+    free(tasks);
+    return count;
+#else
+    return 0;
+#endif
+}
@@ -1,4 +1,5 @@
 #include "hardware.h"
+#include "bsp_tasks.h"
 
 #include <driver/gpio.h>
 #include <driver/spi_master.h>
@@ -166,6 +167,9 @@ esp_err_t bsp_rp2040_init() {
         return res;
     }
 
+    // The driver creates its interrupt task itself, apply the configured priority to it
+    bsp_task_adopt(BSP_TASK_RP2040, dev_rp2040._intr_task_handle);
+
     if (rp2040_get_firmware_version(&dev_rp2040, &rp2040_fw_version) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to read RP2040 firmware version");
         return ESP_FAIL;
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <esp_err.h>
+#include <esp_partition.h>
+
+/** \brief SPI clock used for loading bitstreams */
+#ifndef BSP_ICE40_LOAD_SPEED
+#define BSP_ICE40_LOAD_SPEED 26700000
+#endif
+
+/** \brief Size of each of the two DMA buffers a bitstream is streamed through
+ *
+ * \details One SPI transaction per buffer, so this may not exceed SPI_MAX_TRANSFER_SIZE.
+ */
+#define BSP_ICE40_CHUNK_SIZE 4092
+
+/** \brief Number of SPI transactions a bulk transfer keeps queued
+ *
+ * \details Each transaction moves up to SPI_MAX_TRANSFER_SIZE rounded down to a multiple of 4.
+ */
+#ifndef BSP_ICE40_BULK_DEPTH
+#define BSP_ICE40_BULK_DEPTH 4
+#endif
+
+/** \brief Number of bulk transfers that can wait for the bulk task */
+#ifndef BSP_ICE40_BULK_QUEUE_LENGTH
+#define BSP_ICE40_BULK_QUEUE_LENGTH 8
+#endif
+
+/** \brief SPI command that posts a mailbox request to the FPGA, see bsp_ice40_mailbox_post() */
+#ifndef BSP_ICE40_MAILBOX_POST
+#define BSP_ICE40_MAILBOX_POST 0xF0
+#endif
+
+/** \brief SPI command that fetches a mailbox response from the FPGA */
+#ifndef BSP_ICE40_MAILBOX_FETCH
+#define BSP_ICE40_MAILBOX_FETCH 0xF1
+#endif
+
+/** \brief Largest mailbox request or response payload in bytes, at most 255 */
+#ifndef BSP_ICE40_MAILBOX_SIZE
+#define BSP_ICE40_MAILBOX_SIZE 64
+#endif
+
+/** \brief Number of mailbox requests that can wait for a response at the same time */
+#ifndef BSP_ICE40_MAILBOX_SLOTS
+#define BSP_ICE40_MAILBOX_SLOTS 8
+#endif
+
+/** \brief Magic number at the start of compressed bitstreams, see bsp_ice40_load_compressed_stream() */
+#define BSP_ICE40_COMPRESSED_MAGIC "ICEZ"
+
+/** \brief Reads the next part of a bitstream
+ *
+ * \details Stores at most `size` bytes in `buffer` and the number of bytes stored in
+ *          `length`, which is 0 at the end of the bitstream.
+ */
+typedef esp_err_t (*bsp_ice40_read_t)(void* ctx, uint8_t* buffer, size_t size, size_t* length);
+
+/** \brief Load a bitstream into the ICE40 FPGA while it is being read
+ *
+ * \details The bitstream is read in parts of BSP_ICE40_CHUNK_SIZE into two DMA buffers,
+ *          so reading the next part overlaps with sending the previous one and the
+ *          bitstream never has to fit in RAM. The SPI bus is held for the whole load, so
+ *          the display cannot be updated in the meantime.
+ *
+ *          Loads, bulk transfers and mailbox requests drive the FPGA's CS pin themselves
+ *          and hand it back to the ICE40 driver (get_ice40()) when they are done. They hold
+ *          the SPI bus meanwhile, but nothing coordinates them with the driver's own CS
+ *          handling: do not call the driver from another task while one of these runs.
+ *
+ * \retval ESP_OK                The FPGA was configured and indicates done
+ * \retval ESP_ERR_NO_MEM        The DMA buffers could not be allocated
+ * \retval ESP_ERR_INVALID_STATE bsp_ice40_init() was not called
+ * \retval ESP_FAIL              The FPGA did not accept the bitstream
+ *
+ * Errors returned by `read` are passed on.
+ */
+
+esp_err_t bsp_ice40_load_stream(bsp_ice40_read_t read, void* ctx);
+
+/** \brief Whether the ICE40 FPGA runs the bitstream with the given SHA-256
+ *
+ * \details The BSP remembers the hash of the last bitstream it loaded for as long as the
+ *          FPGA indicates done, so resetting the FPGA or losing power forgets it. Bitstreams
+ *          loaded through the ICE40 driver directly, e.g. by another app, also leave the FPGA
+ *          done, and the BSP cannot tell them apart: the answer is only reliable if all loads
+ *          go through the BSP or bsp_ice40_forget_loaded() is called after the others.
+ */
+
+bool bsp_ice40_is_loaded(const uint8_t* sha256);
+
+/** \brief Forget which bitstream the ICE40 FPGA runs
+ *
+ * \details Call this after loading a bitstream through the ICE40 driver directly.
+ */
+
+void bsp_ice40_forget_loaded();
+
+/** \brief Load a compressed bitstream into the ICE40 FPGA while it is being read
+ *
+ * \details Compressed bitstreams are made by tools/ice40_compress.py. They start with a
+ *          44 byte header: BSP_ICE40_COMPRESSED_MAGIC, a version byte (1), three reserved
+ *          bytes, the little endian length of the bitstream and its SHA-256. Then follow
+ *          tokens, which are decompressed straight into the DMA buffers:
+ *
+ *          - 0x00 to 0x7F: the next token + 1 bytes are copied
+ *          - 0x80 to 0xBF: ((token & 0x3F) << 8 | next byte) + 1 zero bytes
+ *          - 0xC0 to 0xFF: (token & 0x3F) + 3 times the next byte
+ *
+ * \param skip_loaded Do nothing if the FPGA runs this bitstream already, see bsp_ice40_is_loaded()
+ *
+ * \retval ESP_ERR_INVALID_CRC     The decompressed bitstream does not match its SHA-256, the FPGA is held in reset
+ * \retval ESP_ERR_INVALID_VERSION Not a compressed bitstream, or a newer version
+ * \retval ESP_ERR_INVALID_SIZE    The compressed data ended early
+ *
+ * Otherwise as bsp_ice40_load_stream().
+ */
+
+esp_err_t bsp_ice40_load_compressed_stream(bsp_ice40_read_t read, void* ctx, bool skip_loaded);
+
+/** \brief Load a bitstream into the ICE40 FPGA from an open file, e.g. on the SD card
+ *
+ * \details Reads from the current position of `file` to its end. Compressed bitstreams are
+ *          recognized by their header. With `skip_loaded`, raw bitstreams are hashed before
+ *          loading if the FPGA runs a known bitstream. See bsp_ice40_load_compressed_stream().
+ */
+
+esp_err_t bsp_ice40_load_file(FILE* file, bool skip_loaded);
+
+/** \brief Load a bitstream into the ICE40 FPGA from a flash partition
+ *
+ * \details Reads `length` bytes starting at `offset` into the partition. Compressed bitstreams
+ *          are recognized by their header. With `skip_loaded`, raw bitstreams are hashed before
+ *          loading if the FPGA runs a known bitstream. See bsp_ice40_load_compressed_stream().
+ */
+
+esp_err_t bsp_ice40_load_partition(const esp_partition_t* partition, size_t offset, size_t length, bool skip_loaded);
+
+typedef struct bsp_ice40_bulk bsp_ice40_bulk_t;
+
+/** \brief Called from the bulk task when a bulk transfer is done, see bsp_ice40_bulk_queue() */
+typedef void (*bsp_ice40_bulk_cb_t)(bsp_ice40_bulk_t* transfer);
+
+/** \brief Bulk transfer between the ESP32 and the FPGA logic
+ *
+ * \details CS is held low for the whole transfer: first `command` is sent, then `length` bytes
+ *          are written from `tx`, read into `rx` or both at the same time. The mode follows
+ *          from the buffers: writes use the turbo speed, reads the half duplex speed and
+ *          transfers in both directions the full duplex speed.
+ *
+ *          The SPI DMA uses the buffers directly if they are in internal memory (MALLOC_CAP_DMA)
+ *          and, for reads, 4-byte aligned with a length that is a multiple of 4. Other buffers
+ *          work but are copied through a temporary buffer by the SPI driver.
+ */
+struct bsp_ice40_bulk {
+    uint8_t             command;
+    const void*         tx;        /**< Data to write, NULL to only read */
+    void*               rx;        /**< Buffer to read into, NULL to only write */
+    size_t              length;    /**< In bytes, not limited to SPI_MAX_TRANSFER_SIZE */
+    bsp_ice40_bulk_cb_t callback;  /**< Optional */
+    void*               ctx;       /**< For the callback */
+    esp_err_t           result;    /**< Set when the transfer is done */
+};
+
+/** \brief Bulk transfer throughput since boot or the last bsp_ice40_bulk_reset_stats() */
+typedef struct {
+    uint32_t transfers;        /**< Successful transfers */
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    uint64_t busy_us;          /**< Time spent transferring */
+    uint32_t throughput_kbps;  /**< Sustained throughput while transferring, both directions added up */
+} bsp_ice40_bulk_stats_t;
+
+/** \brief Queue a bulk transfer to or from the ICE40 FPGA
+ *
+ * \details Transfers run one after another in the BSP_TASK_ICE40_BULK task, which is created
+ *          on first use. `transfer` and its buffers must stay valid until the callback is
+ *          called. Transfers wait for bitstream loads and keep the display off the bus while
+ *          they run.
+ *
+ * \retval ESP_OK                The transfer was queued
+ * \retval ESP_ERR_INVALID_ARG   Neither `tx` nor `rx` is set
+ * \retval ESP_ERR_INVALID_STATE bsp_ice40_init() was not called
+ * \retval ESP_ERR_NO_MEM        The bulk task could not be created
+ */
+
+esp_err_t bsp_ice40_bulk_queue(bsp_ice40_bulk_t* transfer);
+
+/** \brief Run a bulk transfer to or from the ICE40 FPGA and wait for it
+ *
+ * \details Queues `transfer` behind the transfers queued already, overwriting its callback.
+ *          See bsp_ice40_bulk_queue().
+ *
+ * \retval The result of the transfer
+ */
+
+esp_err_t bsp_ice40_bulk_transfer(bsp_ice40_bulk_t* transfer);
+
+/** \brief Fetch the bulk transfer throughput
+ */
+
+void bsp_ice40_bulk_get_stats(bsp_ice40_bulk_stats_t* stats);
+
+/** \brief Reset the bulk transfer throughput
+ */
+
+void bsp_ice40_bulk_reset_stats();
+
+/** \brief Called from the mailbox task with the response to a mailbox request
+ *
+ * \details `result` is ESP_OK with the response payload, or ESP_ERR_TIMEOUT without one.
+ *          The payload is only valid during the call. Do not block in the callback: the
+ *          mailbox task handles all responses.
+ */
+typedef void (*bsp_ice40_mailbox_cb_t)(void* ctx, esp_err_t result, const uint8_t* response, size_t length);
+
+/** \brief Post a request to the mailbox of the FPGA logic
+ *
+ * \details The mailbox saves polling the FPGA over the shared SPI bus: the FPGA pulls
+ *          GPIO_INT_FPGA low while it has responses and the BSP_TASK_ICE40_MAILBOX task,
+ *          created on first use, fetches them. Each request carries a tag, so the FPGA may
+ *          answer requests in any order. The FPGA logic implements two SPI commands:
+ *
+ *          - BSP_ICE40_MAILBOX_POST, followed by the tag, `command`, the length and the payload
+ *          - BSP_ICE40_MAILBOX_FETCH, after which the FPGA sends the tag and length of its
+ *            oldest response followed by the payload, and drops it
+ *
+ *          Responses with tag 0 are messages the FPGA sends on its own, which go to the
+ *          handler set with bsp_ice40_mailbox_set_handler().
+ *
+ *          If the FPGA keeps GPIO_INT_FPGA low without responses, for example because the
+ *          bitstream has no mailbox, the task backs off and then ignores the interrupt until
+ *          the next request is posted.
+ *
+ * \param timeout_ms Time after which the callback gets ESP_ERR_TIMEOUT, 0 to wait forever
+ *
+ * \retval ESP_OK                The request was sent, `callback` will be called once
+ * \retval ESP_ERR_INVALID_ARG   The payload is larger than BSP_ICE40_MAILBOX_SIZE
+ * \retval ESP_ERR_INVALID_STATE bsp_ice40_init() was not called
+ * \retval ESP_ERR_NO_MEM        BSP_ICE40_MAILBOX_SLOTS requests wait already, or the task could not be created
+ */
+
+esp_err_t bsp_ice40_mailbox_post(uint8_t command, const void* request, size_t length, uint32_t timeout_ms, bsp_ice40_mailbox_cb_t callback, void* ctx);
+
+/** \brief Send a request to the mailbox of the FPGA logic and wait for the response
+ *
+ * \details Stores the response payload in `response` and its length in `response_length`,
+ *          which may be NULL. See bsp_ice40_mailbox_post().
+ *
+ * \param timeout_ms Time to wait for the response, 0 blocks until the FPGA answers however long that takes
+ *
+ * \retval ESP_OK                The response was received
+ * \retval ESP_ERR_TIMEOUT       The FPGA did not respond within `timeout_ms`
+ * \retval ESP_ERR_INVALID_SIZE  The response is larger than `response_size`
+ * \retval ESP_ERR_INVALID_STATE Called from a mailbox callback
+ */
+
+esp_err_t bsp_ice40_mailbox_request(uint8_t command, const void* request, size_t length, void* response, size_t response_size, size_t* response_length,
+                                    uint32_t timeout_ms);
+
+/** \brief Set the handler for messages the FPGA sends on its own (tag 0)
+ *
+ * \details Starts the mailbox task, so the messages arrive without posting a request first.
+ *          NULL drops these messages.
+ */
+
+esp_err_t bsp_ice40_mailbox_set_handler(bsp_ice40_mailbox_cb_t handler, void* ctx);
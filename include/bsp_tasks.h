@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/** \brief Core that runs the radio: the WiFi driver and the BSP's WiFi tasks
+ *
+ * \details The other core is left to the application's real-time work such as input and display.
+ */
+#ifndef BSP_RADIO_CORE
+#define BSP_RADIO_CORE 0
+#endif
+
+/** \brief Tasks the BSP creates or drives */
+typedef enum {
+    BSP_TASK_WIFI,          /**< WiFi driver task, only the core applies */
+    BSP_TASK_WIFI_EVENTS,   /**< WiFi event dispatcher (wifi_subscribe) */
+    BSP_TASK_WIFI_HEALTH,   /**< Gateway probes of the connectivity watchdog, applies from the next connection, the core does not apply */
+    BSP_TASK_WIFI_CONNECT,  /**< Background connection to the stored networks */
+    BSP_TASK_RP2040,        /**< RP2040 interrupt handler, the core and stack size do not apply */
+    BSP_TASK_ICE40_BULK,    /**< ICE40 bulk transfers (bsp_ice40_bulk_queue) */
+    BSP_TASK_ICE40_MAILBOX, /**< ICE40 mailbox responses (bsp_ice40_mailbox_post) */
+    BSP_TASK_COUNT,
+} bsp_task_id_t;
+
+/** \brief Placement of a task */
+typedef struct {
+    const char* name;
+    BaseType_t  core;        /**< 0, 1 or tskNO_AFFINITY */
+    UBaseType_t priority;    /**< 0 keeps the driver's own priority for adopted tasks, see bsp_task_adopt */
+    uint32_t    stack_size;  /**< In bytes */
+} bsp_task_config_t;
+
+/** \brief CPU time and stack use of a task */
+typedef struct {
+    char        name[configMAX_TASK_NAME_LEN];
+    int         bsp_task;     /**< bsp_task_id_t, or -1 for tasks not created or driven by the BSP */
+    BaseType_t  core;         /**< Core the task is pinned to, tskNO_AFFINITY if not pinned */
+    UBaseType_t priority;
+    uint32_t    stack_free;   /**< Least free stack so far in bytes */
+    uint32_t    run_time;     /**< Run time counter */
+    uint8_t     cpu_percent;  /**< Share of the run time of one core since boot */
+} bsp_task_stats_t;
+
+/** \brief Fetch the placement of a BSP task
+ *
+ * \retval struct:bsp_task_config_t The placement, NULL for an invalid task
+ */
+
+const bsp_task_config_t* bsp_task_get_config(bsp_task_id_t task);
+
+/** \brief Change the placement of a BSP task
+ *
+ * \details The priority is applied right away if the task is running, unless it is 0 for a task
+ *          adopted from a driver. The core and stack size apply when the task is created, so set
+ *          these before initializing WiFi and the RP2040.
+ *
+ * \retval ESP_OK              The function succesfully executed
+ * \retval ESP_ERR_INVALID_ARG Invalid task or placement
+ */
+
+esp_err_t bsp_task_set_config(bsp_task_id_t task, const bsp_task_config_t* config);
+
+/** \brief Create a BSP task with its configured placement
+ *
+ * \details A priority of 0 creates the task at idle priority.
+ *
+ * \retval pdPASS The task was created
+ */
+
+BaseType_t bsp_task_create(bsp_task_id_t task, TaskFunction_t function, void* arg);
+
+/** \brief Fetch the handle of a BSP task created with bsp_task_create or adopted with bsp_task_adopt
+ *
+ * \details The handle is set before the task first runs.
+ *
+ * \retval The handle, NULL if the task is not running
+ */
+
+TaskHandle_t bsp_task_get_handle(bsp_task_id_t task);
+
+/** \brief Delete the calling task, which was created with bsp_task_create
+ */
+
+void bsp_task_exit(bsp_task_id_t task);
+
+/** \brief Track a task a driver created itself and apply the configured priority to it
+ *
+ * \details `handle` is the task handle the driver reports. A configured priority of 0 keeps the
+ *          priority the driver gave the task. Call bsp_task_forget before the driver deletes the
+ *          task.
+ */
+
+void bsp_task_adopt(bsp_task_id_t task, TaskHandle_t handle);
+
+/** \brief Stop tracking a task adopted with bsp_task_adopt
+ *
+ * \details Must be called before the task is deleted, after which bsp_task_get_handle returns NULL.
+ */
+
+void bsp_task_forget(bsp_task_id_t task);
+
+/** \brief Fetch the CPU time and stack use of all tasks
+ *
+ * \details Requires CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+ *
+ * \retval The number of tasks stored in `stats`, 0 if not supported
+ */
+
+size_t bsp_task_get_stats(bsp_task_stats_t* stats, size_t max_stats);
@@ -19,6 +19,9 @@
  *          I2C and SPI communication busses and the LCD display driver. Returns ESP_OK
  *          on success and a
  *
+ *          To bring up WiFi in parallel, call wifi_connect_to_stored_background() from
+ *          wifi_connect.h before this function.
+ *
  * \retval ESP_OK   The function succesfully executed
  * \retval ESP_FAIL The function failed, possibly indicating hardware failure
  *
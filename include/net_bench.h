@@ -0,0 +1,79 @@
+#pragma once
+
+// Network benchmark, built into the component with CONFIG_BSP_NET_BENCH.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#else
+// Built on the host by tools/net_bench_host.c.
+typedef int esp_err_t;
+#define ESP_OK              0
+#define ESP_FAIL            -1
+#define ESP_ERR_NO_MEM      0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_TIMEOUT     0x107
+#endif
+
+// Default port for the control connection, the UDP tests use the same port number.
+#define NET_BENCH_PORT 5201
+
+// Defaults for the test parameters.
+#define NET_BENCH_DURATION_MS 10000
+#define NET_BENCH_TCP_SIZE    1460
+#define NET_BENCH_UDP_SIZE    1400
+#define NET_BENCH_RTT_COUNT   100
+#define NET_BENCH_RTT_INTERVAL_MS 100
+
+// Tests.
+typedef enum {
+    NET_BENCH_TCP,  // TCP throughput from client to server.
+    NET_BENCH_UDP,  // UDP throughput and loss from client to server, optionally at a fixed rate.
+    NET_BENCH_RTT,  // UDP round trip times, the server echoes.
+} net_bench_mode_t;
+
+// Test parameters. The client sends them to the server, so only `port` matters for the server.
+typedef struct {
+    net_bench_mode_t mode;
+    const char*      host;         // Client only: address or name of the server.
+    uint16_t         port;
+    uint32_t         duration_ms;  // TCP, UDP: how long to send.
+    uint32_t         size;         // TCP: bytes per write, UDP, RTT: bytes per datagram.
+    uint32_t         rate_kbps;    // UDP: target rate, 0 to send as fast as possible.
+    uint32_t         count;        // RTT: number of probes.
+    uint32_t         interval_ms;  // RTT: time between probes.
+} net_bench_config_t;
+
+// Results of a test as measured on one side, fields not used by the test are 0.
+typedef struct {
+    net_bench_mode_t mode;
+    bool             server;            // Whether these are the server's results.
+    uint32_t         duration_ms;
+    uint64_t         bytes_sent;
+    uint64_t         bytes_received;    // Client: as reported by the server.
+    uint32_t         packets_sent;
+    uint32_t         packets_received;  // Client: as reported by the server, RTT: replies.
+    uint32_t         packets_lost;
+    uint32_t         throughput_kbps;   // Based on the bytes received by the server.
+    uint32_t         rtt_min_us;
+    uint32_t         rtt_avg_us;
+    uint32_t         rtt_max_us;
+    uint32_t         rtt_jitter_us;     // Mean difference between consecutive RTTs.
+} net_bench_result_t;
+
+// Fill in the default test parameters.
+void net_bench_default_config(net_bench_config_t* config);
+
+// Run one test against a server.
+// Retries connecting for a second, so a server that is just starting is fine.
+esp_err_t net_bench_client(const net_bench_config_t* config, net_bench_result_t* result);
+
+// Wait for one client and run the test it asks for.
+esp_err_t net_bench_server(const net_bench_config_t* config, net_bench_result_t* result);
+
+// Format results as one line of JSON, on the badge including the WiFi power save state and signal.
+// Returns the length of the JSON, like snprintf.
+int net_bench_format_json(const net_bench_result_t* result, char* buffer, size_t buffer_size);
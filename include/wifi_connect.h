@@ -1,10 +1,93 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "esp_wifi.h"
 #include "esp_wifi_types.h"
 #include "esp_wpa2.h"
 
+// Maximum number of stored networks.
+#define WIFI_MAX_STORED_NETWORKS 8
+
+// A stored network.
+typedef struct {
+    char     ssid[33];
+    char     password[129];
+    char     ident[129];       // WPA2 enterprise only.
+    char     anon_ident[129];  // WPA2 enterprise only.
+    uint8_t  authmode;         // wifi_auth_mode_t
+    uint8_t  phase2;           // esp_eap_ttls_phase2_types, WPA2 enterprise only.
+    // Maintained by `wifi_connect_to_stored`.
+    uint8_t  bssid[6];         // AP last connected to.
+    uint8_t  channel;          // Channel of that AP, 0 if unknown.
+    uint8_t  ap_authmode;      // Authentication mode of that AP.
+    uint32_t last_success;     // Increases with every successful connection, 0 if never connected.
+} wifi_stored_network_t;
+
+// Progress of `wifi_connect_to_stored_async`.
+typedef enum {
+    WIFI_CONNECT_STAGE_READING_CONFIG,  // Reading the stored networks from NVS.
+    WIFI_CONNECT_STAGE_SCANNING,        // Looking for the stored networks.
+    WIFI_CONNECT_STAGE_ASSOCIATING,     // Connecting to `ssid`.
+    WIFI_CONNECT_STAGE_DHCP,            // Associated with `ssid`, getting an IP address.
+    // Final stages, reported once.
+    WIFI_CONNECT_STAGE_CONNECTED,
+    WIFI_CONNECT_STAGE_FAILED,          // None of the stored networks could be connected to.
+    WIFI_CONNECT_STAGE_CANCELLED,       // Stopped by `wifi_connect_to_stored_cancel`.
+    WIFI_CONNECT_STAGE_TIMEOUT,
+} wifi_connect_stage_t;
+
+typedef struct {
+    wifi_connect_stage_t stage;
+    const char*          ssid;        // Network being tried, NULL if none yet. Only valid during the callback.
+    uint32_t             elapsed_ms;  // Since the start of the connection.
+} wifi_connect_progress_t;
+
+// Called by the connect task when the connection progresses.
+typedef void (*wifi_connect_progress_cb_t)(const wifi_connect_progress_t* progress, void* ctx);
+
+// Connect to the best stored network.
+// Tries the AP that worked last time directly first, then ranks the stored networks
+// found in a single (cached if fresh) scan by signal strength, security and
+// how recently they worked.
+// Waits until connected or out of options, use `wifi_connect_to_stored_async` to keep a UI running.
+// Returns whether WiFi has successfully connected.
 bool wifi_connect_to_stored();
+
+// Connect to the best stored network like `wifi_connect_to_stored`, but from a background task.
+// Returns right away, `callback` (may be NULL) is called from that task for every stage.
+// Gives up after `timeout_ms`, or never if it's 0. WiFi is turned off if it doesn't connect,
+// unless the app keeps it running with `wifi_start`.
+// A scan that is running when it times out or is cancelled finishes first, which takes up to a few seconds.
+// Returns ESP_ERR_INVALID_STATE if a connection to a stored network is being made already.
+esp_err_t wifi_connect_to_stored_async(wifi_connect_progress_cb_t callback, void* ctx, uint32_t timeout_ms);
+
+// Stop `wifi_connect_to_stored_async`, which reports WIFI_CONNECT_STAGE_CANCELLED unless it finished already.
+// Returns right away, the report follows once a scan in progress is done.
+void wifi_connect_to_stored_cancel();
+
+// Initialise WiFi, then start it and connect to the best stored network in a background task.
+// Call this before `bsp_init` so the radio starts and associates while the display and
+// sensors are brought up. NVS must be initialised already.
+// Use `wifi_await` or `wifi_subscribe` to find out when WiFi is connected.
+esp_err_t wifi_connect_to_stored_background();
+
+// Read the stored networks into `networks`.
+// The first network is kept in sync with the `wifi.*` keys the launcher and older apps use,
+// a network configured there by another app is added (or moved) to the front.
+// Reads the configuration blob and the `wifi.ssid` and `wifi.password` keys, the other
+// `wifi.*` keys only when another app changed the network.
+// Returns the number of networks read.
+size_t wifi_get_stored_networks(wifi_stored_network_t* networks, size_t max_networks);
+
+// Add a stored network, or update it if one with the same SSID exists.
+// Returns ESP_ERR_NO_MEM if all WIFI_MAX_STORED_NETWORKS slots are taken.
+esp_err_t wifi_store_network(const wifi_stored_network_t* network);
+
+// Remove the stored network with the given SSID.
+// Returns ESP_ERR_NOT_FOUND if there is no such network.
+esp_err_t wifi_forget_network(const char* ssid);
+
 void wifi_disconnect_and_disable();
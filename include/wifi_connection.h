@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "esp_wifi.h"
 #include "esp_wifi_types.h"
 #include "esp_wpa2.h"
@@ -21,14 +23,214 @@ typedef enum {
 #define WIFI_THRESH_GOOD      -70
 #define WIFI_THRESH_VERY_GOOD -67
 
+// Number of APs remembered by the scan cache.
+#ifndef WIFI_SCAN_CACHE_SIZE
+#define WIFI_SCAN_CACHE_SIZE 32
+#endif
+// Number of AP records taken from the driver per scan, statically allocated.
+#ifndef WIFI_SCAN_POOL_SIZE
+#define WIFI_SCAN_POOL_SIZE 32
+#endif
+// Default time in milliseconds for which `wifi_scan` returns cached results.
+#define WIFI_SCAN_CACHE_TTL_MS 10000
+// Time in milliseconds after which APs that were not seen again are dropped from the scan cache.
+#define WIFI_SCAN_CACHE_MAX_AGE_MS 60000
+
+// Highest channel scanned.
+#define WIFI_SCAN_MAX_CHANNEL 13
+
+// Per-channel dwell times in milliseconds of the scan profiles.
+#define WIFI_SCAN_FAST_DWELL_MS     40
+#define WIFI_SCAN_THOROUGH_DWELL_MS 300
+#define WIFI_SCAN_PASSIVE_DWELL_MS  360
+
 // Retry forever.
 #define WIFI_INFINITE_RETRIES 255
 
+// Reconnection backoff in milliseconds: the delay doubles with every attempt up to the maximum.
+#define WIFI_BACKOFF_BASE_MS      250
+#define WIFI_BACKOFF_AUTH_BASE_MS 2000  // Base delay after authentication failures.
+#define WIFI_BACKOFF_MAX_MS       30000
+
+// Number of connections the connection timing moving averages roughly cover.
+#define WIFI_TIMING_AVG_WINDOW 8
+
+// Number of disconnects remembered for `wifi_get_reconnect_history`.
+#define WIFI_RECONNECT_HISTORY 8
+
+// Default roaming policy, see `wifi_set_roaming`.
+#define WIFI_ROAM_RSSI_THRESHOLD    -75
+#define WIFI_ROAM_HYSTERESIS        8
+#define WIFI_ROAM_SCAN_INTERVAL_MS  30000
+// Interval in milliseconds at which the signal of the current AP is checked.
+#define WIFI_LINK_CHECK_INTERVAL_MS 5000
+// Change in dB of the signal that is reported with WIFI_CONNECTION_EVENT_RSSI_CHANGED.
+#define WIFI_RSSI_CHANGE_THRESHOLD  4
+
+// Maximum number of event subscriptions.
+#ifndef WIFI_MAX_SUBSCRIBERS
+#define WIFI_MAX_SUBSCRIBERS 8
+#endif
+// Number of events waiting for the dispatcher task before new ones are dropped.
+#define WIFI_EVENT_QUEUE_LENGTH 16
+
+// Listen intervals in beacon intervals used when associating, see `wifi_power_request`.
+#define WIFI_LISTEN_INTERVAL_DEFAULT 3
+#define WIFI_LISTEN_INTERVAL_IDLE    10
+
+// Latency needs of network traffic, from most to least power saving.
+typedef enum {
+    WIFI_LATENCY_IDLE,         // Little or no traffic: maximum modem sleep, long listen interval.
+    WIFI_LATENCY_BACKGROUND,   // Occasional traffic: minimum modem sleep, wakes every DTIM.
+    WIFI_LATENCY_INTERACTIVE,  // Latency sensitive traffic such as multiplayer games: no modem sleep.
+    WIFI_LATENCY_COUNT,
+} wifi_latency_t;
+
+// Power save state and time spent in each modem sleep mode while WiFi was started.
+typedef struct {
+    wifi_latency_t latency;       // Current latency level.
+    wifi_ps_type_t mode;          // Current modem sleep mode.
+    uint64_t       none_us;       // Time in WIFI_PS_NONE.
+    uint64_t       min_modem_us;  // Time in WIFI_PS_MIN_MODEM.
+    uint64_t       max_modem_us;  // Time in WIFI_PS_MAX_MODEM.
+} wifi_power_stats_t;
+
+// States of the WiFi connection.
+typedef enum {
+    WIFI_STATE_IDLE,        // Not connected and not trying to.
+    WIFI_STATE_CONNECTING,  // Associating or waiting for an IP address.
+    WIFI_STATE_BACKOFF,     // Waiting to retry after a disconnect.
+    WIFI_STATE_CONNECTED,   // Connected and got an IP address.
+    WIFI_STATE_FAILED,      // Ran out of retries.
+} wifi_connection_state_t;
+
+// Snapshot of the WiFi connection state, see `wifi_get_status`.
+typedef struct {
+    wifi_connection_state_t state;
+    bool                    scanning;     // Whether a scan is in progress.
+    uint8_t                 retries;      // Retries since the last successful connection.
+    uint8_t                 max_retries;  // Maximum retries or WIFI_INFINITE_RETRIES.
+    esp_netif_ip_info_t     ip_info;      // Address of the current or last connection.
+} wifi_connection_status_t;
+
+// Policy for moving to a stronger AP of the same network while connected.
+typedef struct {
+    bool     enabled;
+    int8_t   rssi_threshold;    // Look for a better AP when the signal drops below this RSSI.
+    uint8_t  hysteresis;        // Minimum improvement in dB for moving to another AP.
+    uint32_t scan_interval_ms;  // Minimum time between scans for a better AP.
+} wifi_roam_config_t;
+
+// Connection events, see `wifi_subscribe`.
+typedef enum {
+    WIFI_CONNECTION_EVENT_CONNECTING,    // A connection attempt starts.
+    WIFI_CONNECTION_EVENT_CONNECTED,     // Connected and got an IP address.
+    WIFI_CONNECTION_EVENT_DISCONNECTED,  // Disconnected or a connection attempt failed.
+    WIFI_CONNECTION_EVENT_SCAN_DONE,     // A scan finished, the results are in the scan cache.
+    WIFI_CONNECTION_EVENT_RSSI_CHANGED,  // The signal of the current AP changed by WIFI_RSSI_CHANGE_THRESHOLD or more.
+    WIFI_CONNECTION_EVENT_ASSOCIATED,    // Associated with an AP, getting an IP address next.
+} wifi_connection_event_id_t;
+
+// A connection event, fields not used by the event are 0.
+typedef struct {
+    wifi_connection_event_id_t id;
+    uint8_t                    attempt;      // CONNECTING: retries before this attempt.
+    esp_netif_ip_info_t        ip_info;      // CONNECTED: the address.
+    uint8_t                    bssid[6];     // CONNECTED, RSSI_CHANGED, ASSOCIATED: the AP.
+    int8_t                     rssi;         // CONNECTED, RSSI_CHANGED: the signal.
+    uint8_t                    reason;       // DISCONNECTED: wifi_err_reason_t.
+    bool                       retrying;     // DISCONNECTED: whether another attempt follows.
+    size_t                     num_aps;      // SCAN_DONE: number of APs in the scan cache.
+    uint32_t                   duration_ms;  // SCAN_DONE: time the scan took.
+} wifi_connection_event_t;
+
+// Called by the dispatcher task for every connection event.
+typedef void (*wifi_connection_event_cb_t)(const wifi_connection_event_t* event, void* ctx);
+
+// A disconnect and how it was handled.
+typedef struct {
+    int64_t  time_us;   // esp_timer time of the disconnect.
+    uint8_t  reason;    // wifi_err_reason_t
+    uint8_t  attempt;   // Number of retries before this one since the last successful connection.
+    uint32_t delay_ms;  // Backoff before the next attempt.
+    bool     retrying;  // Whether another attempt was made, false if out of retries.
+} wifi_reconnect_attempt_t;
+
+// Timing of a connection, in microseconds since it was started or 0 if not reached (yet).
+// Scanning, authentication (including the 4-way handshake and EAP) and association all
+// happen inside the WiFi driver and are covered by `associated_us` together.
+typedef struct {
+    int64_t  start_us;       // esp_timer time the connection was started or the link was lost.
+    uint64_t started_us;     // WiFi station started (WIFI_EVENT_STA_START), stays 0 when reconnecting.
+    uint64_t associated_us;  // Associated and authenticated (WIFI_EVENT_STA_CONNECTED).
+    uint64_t got_ip_us;      // Got an IP address (IP_EVENT_STA_GOT_IP).
+    uint8_t  retries;        // Number of disconnects before getting connected.
+    uint8_t  last_reason;    // Reason of the last disconnect (wifi_err_reason_t), 0 if none.
+    bool     lease_reused;   // The DHCP server confirmed the last address, needs CONFIG_LWIP_DHCP_RESTORE_LAST_IP.
+} wifi_connect_timing_t;
+
+// Aggregates of one connection phase in microseconds.
+typedef struct {
+    uint32_t count;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint64_t avg_us;  // Moving average over roughly the last WIFI_TIMING_AVG_WINDOW connections.
+} wifi_phase_stats_t;
+
+// Aggregates over all successful connections since boot.
+typedef struct {
+    wifi_phase_stats_t radio;      // Start to WiFi station started.
+    wifi_phase_stats_t associate;  // WiFi station started to associated.
+    wifi_phase_stats_t ip;         // Associated to got an IP address.
+    wifi_phase_stats_t total;      // Start to got an IP address.
+    uint32_t           failures;   // Connections that ran out of retries.
+} wifi_connect_stats_t;
+
+// Scan strategies.
+typedef enum {
+    WIFI_SCAN_PROFILE_DEFAULT,   // All channels, active, driver default dwell time.
+    WIFI_SCAN_PROFILE_FAST,      // Channels our networks were seen on only, active, short dwell time.
+    WIFI_SCAN_PROFILE_THOROUGH,  // All channels including hidden networks, active, long dwell time.
+    WIFI_SCAN_PROFILE_PASSIVE,   // All channels, passive: listens for beacons without transmitting.
+} wifi_scan_profile_t;
+
+// Progress report of an asynchronous scan.
+typedef struct {
+    const wifi_ap_record_t* aps;          // APs found on the channel that was just scanned.
+    size_t                  num_aps;      // Number of entries in `aps`.
+    uint8_t                 channel;      // Channel that was just scanned.
+    bool                    done;         // Whether the scan is finished.
+    int64_t                 duration_us;  // Time since the scan started.
+} wifi_scan_progress_t;
+
+// Called by `wifi_scan_async` for every scanned channel.
+// Runs in the event loop task, so it should return quickly.
+typedef void (*wifi_scan_cb_t)(const wifi_scan_progress_t* progress, void* ctx);
+
+// Get the address of the current or last connection.
+// The contents may change while reading, other tasks than the event loop should use `wifi_get_status`.
 esp_netif_ip_info_t* wifi_get_ip_info();
 
+// Set the roaming policy, roaming is enabled by default.
+// While connected, the signal is checked every WIFI_LINK_CHECK_INTERVAL_MS. When it is below the
+// threshold, the channels our networks were seen on are scanned and the badge reassociates with
+// the strongest AP of the same SSID if it is at least `hysteresis` dB stronger.
+// With CONFIG_WPA_11KV_SUPPORT, the AP is also asked to steer the badge (802.11v) and for
+// its neighbors (802.11k), whose channels are scanned from then on.
+void wifi_set_roaming(const wifi_roam_config_t* config);
+
+// Get the roaming policy.
+void wifi_get_roaming(wifi_roam_config_t* config);
+
+// Get a consistent snapshot of the connection state.
+// Connect, disconnect and scan calls are serialized and the state is only changed by the
+// default event loop task, so this is safe to call from any task.
+void wifi_get_status(wifi_connection_status_t* status);
+
 // First time initialisation of the WiFi stack.
 // Initialises internal resources and ESP32 WiFi.
 // Use this if nothing else initialises ESP32 WiFi.
+// Does nothing if the WiFi stack was initialised already.
 void wifi_init();
 
 // First time initialisation of the WiFi stack.
@@ -36,9 +238,32 @@ void wifi_init();
 // Use this if ESP32 WiFi is already initialised.
 void wifi_init_no_hardware();
 
+// Start the WiFi driver in station mode without connecting.
+// The driver then keeps running between connection attempts and scans until every `wifi_start`
+// is undone by `wifi_stop`, or until `wifi_disconnect`, so connecting soon after doesn't stop
+// and restart the radio.
+esp_err_t wifi_start();
+
+// Undo one `wifi_start`. Once none are left the driver stops after failed connection attempts
+// and scans again, and right away unless a connection or scan is using it.
+void wifi_stop();
+
+// Set the BSSID and channel to associate with on the next connection attempt.
+// This skips the all-channel scan when the AP is already known.
+// The hint is consumed by the next call to one of the connect functions.
+// Pass NULL as `aBssid` to clear the hint.
+void wifi_set_connect_hint(const uint8_t* aBssid, uint8_t aChannel);
+
+// Set how many times to retry after the next connection is established and then lost,
+// instead of the `aRetryMax` passed to the connect function. A directed connect can then
+// give up quickly while the connection it makes still survives the odd disconnect.
+// Consumed by the next call to one of the connect functions, like the connect hint.
+void wifi_set_reconnect_retries(uint8_t aRetryMax);
+
 // Connect to a traditional username/password WiFi network.
 // Will wait for the connection to be established.
 // Will try at most `aRetryMax` times, or forever if it's WIFI_INFINITE_RETRIES.
+// Retries back off exponentially, see WIFI_BACKOFF_BASE_MS.
 // Returns whether WiFi has successfully connected.
 bool wifi_connect(const char* aSsid, const char* aPassword, wifi_auth_mode_t aAuthmode, uint8_t aRetryMax);
 
@@ -56,22 +281,108 @@ void wifi_connect_async(const char* aSsid, const char* aPassword, wifi_auth_mode
 // Connect to a WPA2 enterprise WiFi network.
 // Will return right away.
 // Will try at most `aRetryMax` times, or forever if it's WIFI_INFINITE_RETRIES.
+// When called again for the same network and credentials while WiFi is still started, the
+// driver keeps its PMK cache, so re-authentication skips the full EAP exchange.
 void wifi_connect_ent_async(const char* aSsid, const char *aIdent, const char *aAnonIdent, const char* aPassword, esp_eap_ttls_phase2_types phase2, uint8_t aRetryMax);
 
 // Disconnect from WiFi and do not attempt to reconnect.
+// Also undoes every `wifi_start`, so the driver stops.
 void wifi_disconnect();
 
+// Stop connecting, or disconnect, and do not attempt to reconnect.
+// Unlike `wifi_disconnect` the driver keeps running if `wifi_start` was called.
+void wifi_abort_connect();
+
 // Awaits WiFi to be connected for at most `max_delay_millis` milliseconds or forever if it's 0.
 // Returns whether WiFi has successfully connected.
 bool wifi_await(uint64_t max_delay_millis);
 
+// Get the timing of the current or last connection and aggregates over past connections.
+// Either pointer may be NULL.
+void wifi_get_connect_timing(wifi_connect_timing_t* last, wifi_connect_stats_t* stats);
+
+// Reset the connection timing aggregates.
+void wifi_reset_connect_stats();
+
+// Get the most recent disconnects, newest first.
+// Returns the number of entries stored in `attempts`.
+size_t wifi_get_reconnect_history(wifi_reconnect_attempt_t* attempts, size_t max_attempts);
+
+// Declare latency needs until the matching `wifi_power_release`.
+// The most demanding outstanding request decides the modem sleep mode, or the default if there are none.
+// The listen interval only changes when (re)associating: WIFI_LISTEN_INTERVAL_IDLE is used if the
+// latency level is WIFI_LATENCY_IDLE at that time, WIFI_LISTEN_INTERVAL_DEFAULT otherwise.
+void wifi_power_request(wifi_latency_t latency);
+
+// Withdraw a request made with `wifi_power_request`.
+void wifi_power_release(wifi_latency_t latency);
+
+// Set the latency level used when there are no requests, WIFI_LATENCY_BACKGROUND by default.
+void wifi_power_set_default(wifi_latency_t latency);
+
+// Get the current power save state and the time spent in each modem sleep mode.
+void wifi_power_get_stats(wifi_power_stats_t* stats);
+
+// Call `callback` for every connection event, instead of polling `wifi_is_connected`.
+// All subscribers are served in order by one dispatcher task, so callbacks should return quickly.
+// Returns ESP_ERR_NO_MEM if WIFI_MAX_SUBSCRIBERS are subscribed already.
+esp_err_t wifi_subscribe(wifi_connection_event_cb_t callback, void* ctx);
+
+// Stop calling a callback added with `wifi_subscribe` with the same `ctx`.
+esp_err_t wifi_unsubscribe(wifi_connection_event_cb_t callback, void* ctx);
+
+// Send a copy of every connection event to a queue of `wifi_connection_event_t`.
+// Events are dropped when the queue is full.
+esp_err_t wifi_subscribe_queue(QueueHandle_t queue);
+
+// Stop sending events to a queue added with `wifi_subscribe_queue`.
+esp_err_t wifi_unsubscribe_queue(QueueHandle_t queue);
+
 // Test whether WiFi is currently connected.
 bool wifi_is_connected();
 
 // Scan for WiFi networks.
-// Updates the APs pointer if non-null.
+// Returns cached results if the last scan is younger than the cache TTL.
+// Results of new scans are merged with APs seen recently, strongest first.
+// Updates the APs pointer if non-null, the caller must free the list.
 // Returns the number of APs found.
 size_t wifi_scan(wifi_ap_record_t **aps);
 
+// Scan for WiFi networks one channel at a time.
+// Will return right away, `callback` is called with the APs found after each channel.
+// The results are merged into the scan cache as well.
+// Returns ESP_ERR_INVALID_STATE if a scan is already in progress, or the error that kept the
+// scan from starting, in which case `callback` is never called.
+esp_err_t wifi_scan_async(wifi_scan_cb_t callback, void* ctx);
+
+// Scan for WiFi networks using the given strategy, ignoring the scan cache TTL.
+// Stores the time the scan took in `duration_ms` if non-null.
+// Otherwise the same as `wifi_scan`.
+size_t wifi_scan_with_profile(wifi_scan_profile_t profile, wifi_ap_record_t **aps, uint32_t* duration_ms);
+
+// Scan for WiFi networks one channel at a time using the given strategy.
+// Otherwise the same as `wifi_scan_async`.
+esp_err_t wifi_scan_async_with_profile(wifi_scan_profile_t profile, wifi_scan_cb_t callback, void* ctx);
+
+// Mark a channel as used by one of our networks, for WIFI_SCAN_PROFILE_FAST.
+// Channels are also learned automatically when connecting.
+void wifi_scan_add_known_channel(uint8_t channel);
+
+// Get direct access to the scan cache without copying, strongest AP first.
+// Use `wifi_scan(NULL)` first to refresh the cache without allocating a list.
+// The cache is locked until `wifi_scan_release_results` is called, which should be done
+// soon since scans wait for it.
+// Returns the number of APs in `aps`.
+size_t wifi_scan_get_results(const wifi_ap_record_t** aps);
+
+// Release access to the scan cache obtained with `wifi_scan_get_results`.
+void wifi_scan_release_results();
+
+// Set how long `wifi_scan` returns cached results in milliseconds, or 0 to always scan.
+void wifi_scan_set_cache_ttl(uint32_t ttl_ms);
+
+// Forget all cached scan results.
+void wifi_scan_flush_cache();
+
 // Get the strength value for a given RSSI.
 wifi_strength_t wifi_rssi_to_strength(int8_t rssi);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Default probing cadence, see `wifi_health_start`.
+#define WIFI_HEALTH_INTERVAL_MS  10000
+#define WIFI_HEALTH_TIMEOUT_MS   1000
+#define WIFI_HEALTH_MAX_FAILURES 3
+
+// Number of RTT histogram buckets: bucket 0 counts RTTs below 2 ms, bucket `i` RTTs from 2^i up to
+// 2^(i+1) ms and the last bucket everything from 2^(WIFI_HEALTH_RTT_BUCKETS-1) ms up.
+#define WIFI_HEALTH_RTT_BUCKETS 10
+
+// Health watchdog settings.
+typedef struct {
+    uint32_t interval_ms;   // Time between probes while connected.
+    uint32_t timeout_ms;    // Time to wait for a reply.
+    uint8_t  max_failures;  // Consecutive lost probes after which the connection is re-established.
+} wifi_health_config_t;
+
+// Probe results since the watchdog was started or the stats were reset.
+typedef struct {
+    uint32_t probes;                 // Probes sent.
+    uint32_t lost;                   // Probes without a reply.
+    uint32_t reconnects;             // Reconnects triggered by lost probes.
+    uint8_t  consecutive_lost;       // Lost probes since the last reply.
+    uint32_t last_rtt_ms;            // RTT of the last reply.
+    uint32_t min_rtt_ms;
+    uint32_t max_rtt_ms;
+    uint32_t rtt_histogram[WIFI_HEALTH_RTT_BUCKETS];
+} wifi_health_stats_t;
+
+// Start the connectivity watchdog, or change its settings if it's running.
+// While connected, the gateway is pinged (ICMP echo) every `interval_ms`. After `max_failures` lost
+// probes in a row the link is considered dead and WiFi reconnects right away.
+// Gateways that never answered a probe since connecting are not held against the connection,
+// since some networks block ICMP.
+// Pass NULL for the defaults.
+esp_err_t wifi_health_start(const wifi_health_config_t* config);
+
+// Stop the connectivity watchdog.
+void wifi_health_stop();
+
+// Whether the last probe was answered, or no probe was lost since connecting.
+bool wifi_health_ok();
+
+// Get the probe results and RTT histogram.
+void wifi_health_get_stats(wifi_health_stats_t* stats);
+
+// Reset the probe results and RTT histogram.
+void wifi_health_reset_stats();
@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "net_bench.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "wifi_connection.h"
+#else
+#include <time.h>
+#endif
+
+static const char *TAG = "net_bench";
+
+#ifdef ESP_PLATFORM
+#define NET_BENCH_LOGE(...) ESP_LOGE(TAG, __VA_ARGS__)
+#define NET_BENCH_LOGI(...) ESP_LOGI(TAG, __VA_ARGS__)
+#else
+#define NET_BENCH_LOGE(format, ...) fprintf(stderr, "E %s: " format "\n", TAG, ##__VA_ARGS__)
+#define NET_BENCH_LOGI(format, ...) fprintf(stderr, "I %s: " format "\n", TAG, ##__VA_ARGS__)
+#endif
+
+// Control connection messages, all fields are big endian 32-bit words.
+#define NET_BENCH_MAGIC       0x4E42454E  // "NBEN"
+#define NET_BENCH_HEADER_SIZE 28          // magic, mode, duration, size, rate, count, interval.
+#define NET_BENCH_REPORT_SIZE 20          // bytes received (high, low), packets received, packets lost, duration.
+#define NET_BENCH_READY       'R'         // Sent by the server once it can receive test traffic.
+
+// Datagrams start with a sequence number and the send time in microseconds.
+#define NET_BENCH_DATAGRAM_MIN 8
+
+// How long the server keeps receiving UDP datagrams after the client is done.
+#define NET_BENCH_UDP_DRAIN_MS 200
+
+// Monotonic time in microseconds.
+static int64_t net_bench_now_us() {
+#ifdef ESP_PLATFORM
+    return esp_timer_get_time();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+static void net_bench_put_u32(uint8_t* buffer, uint32_t value) {
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+static uint32_t net_bench_get_u32(const uint8_t* buffer) {
+    return ((uint32_t) buffer[0] << 24) | ((uint32_t) buffer[1] << 16) | ((uint32_t) buffer[2] << 8) | buffer[3];
+}
+
+static esp_err_t net_bench_send_all(int sock, const uint8_t* data, size_t length) {
+    while (length) {
+        ssize_t sent = send(sock, data, length, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return ESP_FAIL;
+        data   += sent;
+        length -= sent;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t net_bench_recv_all(int sock, uint8_t* data, size_t length) {
+    while (length) {
+        ssize_t received = recv(sock, data, length, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return ESP_FAIL;
+        data   += received;
+        length -= received;
+    }
+    return ESP_OK;
+}
+
+// Throughput in kbit/s, which conveniently is bits per millisecond.
+static uint32_t net_bench_kbps(uint64_t bytes, uint32_t duration_ms) {
+    return duration_ms ? bytes * 8 / duration_ms : 0;
+}
+
+void net_bench_default_config(net_bench_config_t* config) {
+    memset(config, 0, sizeof(*config));
+    config->mode        = NET_BENCH_TCP;
+    config->port        = NET_BENCH_PORT;
+    config->duration_ms = NET_BENCH_DURATION_MS;
+    config->size        = NET_BENCH_TCP_SIZE;
+    config->count       = NET_BENCH_RTT_COUNT;
+    config->interval_ms = NET_BENCH_RTT_INTERVAL_MS;
+}
+
+// Connects the control connection, retrying for a second in case the server is starting.
+static esp_err_t net_bench_connect(const net_bench_config_t* config, struct sockaddr_in* addr, int* sock_out) {
+    struct addrinfo  hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo* info  = NULL;
+    char             port[6];
+    snprintf(port, sizeof(port), "%u", config->port);
+    if (getaddrinfo(config->host, port, &hints, &info) != 0 || !info) {
+        NET_BENCH_LOGE("Failed to resolve %s", config->host);
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(addr, info->ai_addr, sizeof(*addr));
+    freeaddrinfo(info);
+
+    for (int attempt = 0; attempt < 10; attempt++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return ESP_ERR_NO_MEM;
+        if (connect(sock, (struct sockaddr*) addr, sizeof(*addr)) == 0) {
+            *sock_out = sock;
+            return ESP_OK;
+        }
+        close(sock);
+        usleep(100000);
+    }
+    NET_BENCH_LOGE("Failed to connect to %s:%s: %s", config->host, port, strerror(errno));
+    return ESP_ERR_TIMEOUT;
+}
+
+// Sends TCP data for the configured duration.
+static esp_err_t net_bench_client_tcp(int ctrl, const net_bench_config_t* config, net_bench_result_t* result) {
+    uint8_t* buffer = calloc(1, config->size);
+    if (!buffer) return ESP_ERR_NO_MEM;
+    esp_err_t res   = ESP_OK;
+    int64_t   start = net_bench_now_us();
+    int64_t   end   = start + (int64_t) config->duration_ms * 1000;
+    while (net_bench_now_us() < end) {
+        ssize_t sent = send(ctrl, buffer, config->size, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0) {
+            NET_BENCH_LOGE("Send failed: %s", strerror(errno));
+            res = ESP_FAIL;
+            break;
+        }
+        result->bytes_sent += sent;
+    }
+    result->duration_ms = (net_bench_now_us() - start) / 1000;
+    free(buffer);
+    return res;
+}
+
+// Sends UDP datagrams for the configured duration, paced to the configured rate.
+static esp_err_t net_bench_client_udp(int udp, const net_bench_config_t* config, net_bench_result_t* result) {
+    uint8_t* buffer = calloc(1, config->size);
+    if (!buffer) return ESP_ERR_NO_MEM;
+    esp_err_t res   = ESP_OK;
+    int64_t   start = net_bench_now_us();
+    int64_t   end   = start + (int64_t) config->duration_ms * 1000;
+    int64_t   now;
+    while ((now = net_bench_now_us()) < end) {
+        if (config->rate_kbps) {
+            int64_t due = start + (int64_t) (result->bytes_sent * 8000 / config->rate_kbps);
+            if (due - now >= 1000) usleep(due - now);
+            if (due > now) continue;
+        }
+        net_bench_put_u32(&buffer[0], result->packets_sent);
+        net_bench_put_u32(&buffer[4], (uint32_t) now);
+        ssize_t sent = send(udp, buffer, config->size, 0);
+        if (sent < 0 && (errno == ENOMEM || errno == ENOBUFS || errno == EINTR)) {
+            // Out of buffers, give the stack a moment.
+            usleep(1000);
+            continue;
+        }
+        if (sent < 0) {
+            NET_BENCH_LOGE("Send failed: %s", strerror(errno));
+            res = ESP_FAIL;
+            break;
+        }
+        result->packets_sent++;
+        result->bytes_sent += sent;
+    }
+    result->duration_ms = (net_bench_now_us() - start) / 1000;
+    free(buffer);
+    return res;
+}
+
+// Measures round trip times with datagrams echoed by the server.
+static esp_err_t net_bench_client_rtt(int udp, const net_bench_config_t* config, net_bench_result_t* result) {
+    uint8_t* buffer = calloc(2, config->size);
+    if (!buffer) return ESP_ERR_NO_MEM;
+    uint8_t* reply = buffer + config->size;
+    struct timeval timeout = {.tv_sec = 1};
+    setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint64_t total = 0;
+    uint64_t jitter = 0;
+    uint32_t previous = 0;
+    int64_t  start = net_bench_now_us();
+    for (uint32_t seq = 0; seq < config->count; seq++) {
+        int64_t sent_at = net_bench_now_us();
+        net_bench_put_u32(&buffer[0], seq);
+        net_bench_put_u32(&buffer[4], (uint32_t) sent_at);
+        if (send(udp, buffer, config->size, 0) < 0) {
+            result->packets_lost++;
+        } else {
+            result->packets_sent++;
+            result->bytes_sent += config->size;
+            // Skip late replies to earlier probes.
+            ssize_t received;
+            while ((received = recv(udp, reply, config->size, 0)) >= 0) {
+                if (received >= NET_BENCH_DATAGRAM_MIN && net_bench_get_u32(reply) == seq) break;
+            }
+            if (received < 0) {
+                result->packets_lost++;
+            } else {
+                uint32_t rtt = net_bench_now_us() - sent_at;
+                if (!result->packets_received || rtt < result->rtt_min_us) result->rtt_min_us = rtt;
+                if (rtt > result->rtt_max_us) result->rtt_max_us = rtt;
+                if (result->packets_received) jitter += rtt > previous ? rtt - previous : previous - rtt;
+                previous = rtt;
+                total += rtt;
+                result->packets_received++;
+                result->bytes_received += received;
+            }
+        }
+        int64_t next = sent_at + (int64_t) config->interval_ms * 1000;
+        int64_t now  = net_bench_now_us();
+        if (seq + 1 < config->count && next > now) usleep(next - now);
+    }
+    result->duration_ms = (net_bench_now_us() - start) / 1000;
+    if (result->packets_received) result->rtt_avg_us = total / result->packets_received;
+    if (result->packets_received > 1) result->rtt_jitter_us = jitter / (result->packets_received - 1);
+    free(buffer);
+    return ESP_OK;
+}
+
+// Run one test against a server.
+esp_err_t net_bench_client(const net_bench_config_t* config, net_bench_result_t* result) {
+    if (!config->host || (config->mode != NET_BENCH_TCP && config->size < NET_BENCH_DATAGRAM_MIN)) return ESP_ERR_INVALID_ARG;
+    memset(result, 0, sizeof(*result));
+    result->mode = config->mode;
+
+    struct sockaddr_in addr;
+    int ctrl = -1;
+    int udp  = -1;
+    esp_err_t res = net_bench_connect(config, &addr, &ctrl);
+    if (res) return res;
+
+    // Tell the server what to expect and wait until it's ready.
+    uint8_t message[NET_BENCH_HEADER_SIZE];
+    net_bench_put_u32(&message[0], NET_BENCH_MAGIC);
+    net_bench_put_u32(&message[4], config->mode);
+    net_bench_put_u32(&message[8], config->duration_ms);
+    net_bench_put_u32(&message[12], config->size);
+    net_bench_put_u32(&message[16], config->rate_kbps);
+    net_bench_put_u32(&message[20], config->count);
+    net_bench_put_u32(&message[24], config->interval_ms);
+    res = net_bench_send_all(ctrl, message, NET_BENCH_HEADER_SIZE);
+    if (res == ESP_OK) res = net_bench_recv_all(ctrl, message, 1);
+    if (res == ESP_OK && message[0] != NET_BENCH_READY) res = ESP_FAIL;
+    if (res) {
+        NET_BENCH_LOGE("Server did not accept the test");
+        goto error;
+    }
+
+    if (config->mode == NET_BENCH_TCP) {
+        res = net_bench_client_tcp(ctrl, config, result);
+    } else {
+        udp = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp < 0 || connect(udp, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            res = ESP_FAIL;
+            goto error;
+        }
+        if (config->mode == NET_BENCH_UDP) {
+            res = net_bench_client_udp(udp, config, result);
+        } else {
+            res = net_bench_client_rtt(udp, config, result);
+        }
+    }
+    if (res) goto error;
+
+    // Done, collect what the server saw.
+    shutdown(ctrl, SHUT_WR);
+    res = net_bench_recv_all(ctrl, message, NET_BENCH_REPORT_SIZE);
+    if (res) {
+        NET_BENCH_LOGE("Server did not report");
+        goto error;
+    }
+    uint64_t server_bytes    = ((uint64_t) net_bench_get_u32(&message[0]) << 32) | net_bench_get_u32(&message[4]);
+    uint32_t server_duration = net_bench_get_u32(&message[16]);
+    if (config->mode != NET_BENCH_RTT) {
+        result->bytes_received   = server_bytes;
+        result->packets_received = net_bench_get_u32(&message[8]);
+        result->packets_lost     = net_bench_get_u32(&message[12]);
+        result->throughput_kbps  = net_bench_kbps(server_bytes, server_duration);
+    }
+
+    error:
+    if (udp >= 0) close(udp);
+    close(ctrl);
+    return res;
+}
+
+// Receives TCP data until the client closes.
+static void net_bench_server_tcp(int ctrl, net_bench_result_t* result) {
+    uint8_t buffer[1460];
+    int64_t start = 0;
+    ssize_t received;
+    while ((received = recv(ctrl, buffer, sizeof(buffer), 0)) > 0 || (received < 0 && errno == EINTR)) {
+        if (received < 0) continue;
+        if (!start) start = net_bench_now_us();
+        result->bytes_received += received;
+    }
+    if (start) result->duration_ms = (net_bench_now_us() - start) / 1000;
+}
+
+// Receives or echoes datagrams until the client closes the control connection.
+static void net_bench_server_udp(int ctrl, int udp, net_bench_mode_t mode, uint32_t size, net_bench_result_t* result) {
+    uint8_t* buffer = malloc(size);
+    if (!buffer) return;
+    uint32_t expected = 0;
+    int64_t  first    = 0;
+    int64_t  last     = 0;
+    int64_t  drain_until = 0;
+    while (!drain_until || net_bench_now_us() < drain_until) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(udp, &fds);
+        if (!drain_until) FD_SET(ctrl, &fds);
+        struct timeval timeout = {.tv_usec = 100000};
+        if (select((ctrl > udp ? ctrl : udp) + 1, &fds, NULL, NULL, &timeout) < 0 && errno != EINTR) break;
+
+        if (FD_ISSET(udp, &fds)) {
+            struct sockaddr_in from;
+            socklen_t          from_len = sizeof(from);
+            ssize_t received = recvfrom(udp, buffer, size, 0, (struct sockaddr*) &from, &from_len);
+            if (received >= NET_BENCH_DATAGRAM_MIN) {
+                last = net_bench_now_us();
+                if (!first) first = last;
+                result->packets_received++;
+                result->bytes_received += received;
+                uint32_t seq = net_bench_get_u32(buffer);
+                if (seq >= expected) expected = seq + 1;
+                if (mode == NET_BENCH_RTT && sendto(udp, buffer, received, 0, (struct sockaddr*) &from, from_len) == received) {
+                    result->packets_sent++;
+                    result->bytes_sent += received;
+                }
+            }
+        }
+        if (!drain_until && FD_ISSET(ctrl, &fds)) {
+            // The client closes its side of the control connection when it's done sending.
+            uint8_t dummy;
+            if (recv(ctrl, &dummy, 1, 0) <= 0) {
+                drain_until = net_bench_now_us() + (mode == NET_BENCH_UDP ? NET_BENCH_UDP_DRAIN_MS * 1000 : 0);
+            }
+        }
+    }
+    if (expected > result->packets_received) result->packets_lost = expected - result->packets_received;
+    result->duration_ms = (last - first) / 1000;
+    free(buffer);
+}
+
+// Wait for one client and run the test it asks for.
+esp_err_t net_bench_server(const net_bench_config_t* config, net_bench_result_t* result) {
+    memset(result, 0, sizeof(*result));
+    result->server = true;
+
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(config->port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int reuse    = 1;
+    int ctrl     = -1;
+    int udp      = -1;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return ESP_ERR_NO_MEM;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    esp_err_t res = ESP_FAIL;
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        NET_BENCH_LOGE("Failed to listen on port %u: %s", config->port, strerror(errno));
+        close(listener);
+        return res;
+    }
+    NET_BENCH_LOGI("Waiting for a client on port %u", config->port);
+    ctrl = accept(listener, NULL, NULL);
+    close(listener);
+    if (ctrl < 0) return res;
+
+    uint8_t message[NET_BENCH_HEADER_SIZE];
+    if (net_bench_recv_all(ctrl, message, NET_BENCH_HEADER_SIZE) || net_bench_get_u32(&message[0]) != NET_BENCH_MAGIC) {
+        NET_BENCH_LOGE("Not a benchmark client");
+        goto error;
+    }
+    result->mode  = net_bench_get_u32(&message[4]);
+    uint32_t size = net_bench_get_u32(&message[12]);
+    if (result->mode > NET_BENCH_RTT || (result->mode != NET_BENCH_TCP && size < NET_BENCH_DATAGRAM_MIN)) goto error;
+
+    if (result->mode != NET_BENCH_TCP) {
+        udp = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp < 0 || bind(udp, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            NET_BENCH_LOGE("Failed to bind UDP port %u: %s", config->port, strerror(errno));
+            goto error;
+        }
+    }
+    message[0] = NET_BENCH_READY;
+    if (net_bench_send_all(ctrl, message, 1)) goto error;
+
+    if (result->mode == NET_BENCH_TCP) {
+        net_bench_server_tcp(ctrl, result);
+    } else {
+        net_bench_server_udp(ctrl, udp, result->mode, size, result);
+    }
+    result->throughput_kbps = net_bench_kbps(result->bytes_received, result->duration_ms);
+
+    net_bench_put_u32(&message[0], result->bytes_received >> 32);
+    net_bench_put_u32(&message[4], (uint32_t) result->bytes_received);
+    net_bench_put_u32(&message[8], result->packets_received);
+    net_bench_put_u32(&message[12], result->packets_lost);
+    net_bench_put_u32(&message[16], result->duration_ms);
+    res = net_bench_send_all(ctrl, message, NET_BENCH_REPORT_SIZE);
+
+    error:
+    if (udp >= 0) close(udp);
+    close(ctrl);
+    return res;
+}
+
+// Format results as one line of JSON.
+int net_bench_format_json(const net_bench_result_t* result, char* buffer, size_t buffer_size) {
+    static const char* modes[] = {"tcp", "udp", "rtt"};
+    int length = snprintf(buffer, buffer_size,
+        "{\"role\":\"%s\",\"mode\":\"%s\",\"duration_ms\":%u,\"bytes_sent\":%llu,\"bytes_received\":%llu,"
+        "\"packets_sent\":%u,\"packets_received\":%u,\"packets_lost\":%u,\"throughput_kbps\":%u,"
+        "\"rtt_min_us\":%u,\"rtt_avg_us\":%u,\"rtt_max_us\":%u,\"rtt_jitter_us\":%u",
+        result->server ? "server" : "client", result->mode <= NET_BENCH_RTT ? modes[result->mode] : "?",
+        (unsigned) result->duration_ms, (unsigned long long) result->bytes_sent, (unsigned long long) result->bytes_received,
+        (unsigned) result->packets_sent, (unsigned) result->packets_received, (unsigned) result->packets_lost,
+        (unsigned) result->throughput_kbps, (unsigned) result->rtt_min_us, (unsigned) result->rtt_avg_us,
+        (unsigned) result->rtt_max_us, (unsigned) result->rtt_jitter_us);
+#ifdef ESP_PLATFORM
+    // The settings being measured.
+    wifi_power_stats_t power;
+    wifi_power_get_stats(&power);
+    wifi_ap_record_t ap_info = {0};
+    esp_wifi_sta_get_ap_info(&ap_info);
+    if (length >= 0 && (size_t) length < buffer_size) {
+        length += snprintf(buffer + length, buffer_size - length,
+            ",\"wifi\":{\"ps_mode\":%d,\"latency\":%d,\"rssi\":%d,\"channel\":%u}",
+            power.mode, power.latency, ap_info.rssi, ap_info.primary);
+    }
+#endif
+    if (length >= 0 && (size_t) length < buffer_size) {
+        length += snprintf(buffer + length, buffer_size - length, "}");
+    }
+    return length;
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Compress ICE40 bitstreams for bsp_ice40_load_compressed_stream().
+
+Usage:
+    ice40_compress.py bitstream.bin bitstream.binz
+    ice40_compress.py -d bitstream.binz bitstream.bin
+
+iCE40 bitstreams are mostly long runs of zeros with short stretches of
+configuration data, so the format is a simple run-length code that the
+badge can decompress straight into its SPI DMA buffers:
+
+    0x00-0x7F       copy the next token + 1 bytes
+    0x80-0xBF n     ((token & 0x3F) << 8 | n) + 1 zero bytes
+    0xC0-0xFF b     (token & 0x3F) + 3 times byte b
+
+The tokens follow a 44 byte header: b"ICEZ", version 1, three reserved
+bytes, the little endian length of the bitstream and its SHA-256.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"ICEZ"
+VERSION = 1
+HEADER = struct.Struct("<4sB3xI32s")
+
+MAX_LITERAL = 0x80
+MAX_ZEROS = 0x4000
+MAX_REPEAT = 0x3F + 3
+
+
+def compress(data):
+    out = bytearray(HEADER.pack(MAGIC, VERSION, len(data), hashlib.sha256(data).digest()))
+    literal_start = 0
+    i = 0
+
+    def flush_literals(end):
+        for start in range(literal_start, end, MAX_LITERAL):
+            chunk = data[start:min(start + MAX_LITERAL, end)]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+
+    while i < len(data):
+        value = data[i]
+        run = 1
+        limit = MAX_ZEROS if value == 0 else MAX_REPEAT
+        while i + run < len(data) and run < limit and data[i + run] == value:
+            run += 1
+        # A token is two bytes, only use it where it beats copying.
+        if run >= (3 if value == 0 else 4):
+            flush_literals(i)
+            if value == 0:
+                out.extend(((0x80 | (run - 1) >> 8), (run - 1) & 0xFF))
+            else:
+                out.extend((0xC0 | (run - 3), value))
+            i += run
+            literal_start = i
+        else:
+            i += run
+    flush_literals(len(data))
+    return bytes(out)
+
+
+def decompress(data):
+    magic, version, length, sha256 = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a compressed bitstream")
+    out = bytearray()
+    i = HEADER.size
+    while len(out) < length:
+        token = data[i]
+        if token < 0x80:
+            out.extend(data[i + 1:i + 2 + token])
+            i += 2 + token
+        elif token < 0xC0:
+            out.extend(bytes((((token & 0x3F) << 8) | data[i + 1]) + 1))
+            i += 2
+        else:
+            out.extend(bytes((data[i + 1],)) * ((token & 0x3F) + 3))
+            i += 2
+    out = bytes(out[:length])
+    if hashlib.sha256(out).digest() != sha256:
+        raise ValueError("SHA-256 mismatch")
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress ICE40 bitstreams for the MCH2022 badge")
+    parser.add_argument("-d", "--decompress", action="store_true", help="decompress instead")
+    parser.add_argument("input")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+    result = decompress(data) if args.decompress else compress(data)
+    if not args.decompress and decompress(result) != data:
+        sys.exit("Round trip failed")
+    with open(args.output, "wb") as f:
+        f.write(result)
+    print("{}: {} -> {} bytes".format(args.input, len(data), len(result)), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
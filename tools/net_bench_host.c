@@ -0,0 +1,133 @@
+// Host side peer for the network benchmark in net_bench.c.
+//
+// Build and run the loopback tests from the component directory:
+//   cmake -S tools -B build-host && cmake --build build-host && ctest --test-dir build-host
+//
+// Usage:
+//   net_bench server [options]         Serve tests run by the badge, one after another.
+//   net_bench client HOST [options]    Run a test against a badge running the server.
+//   net_bench loopback [options]       Run both ends over 127.0.0.1, for CI.
+//
+// Options:
+//   -m tcp|udp|rtt  test to run (tcp)
+//   -p PORT         control port (5201)
+//   -t SECONDS      TCP, UDP: duration (10)
+//   -l BYTES        write or datagram size (1460 for TCP, 1400 for UDP and RTT)
+//   -b KBPS         UDP: target rate, 0 for as fast as possible (0)
+//   -n COUNT        RTT: number of probes (100)
+//   -i MS           RTT: time between probes (100)
+//
+// Results are printed to stdout as one JSON object per line.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net_bench.h"
+
+typedef struct {
+    net_bench_config_t config;
+    net_bench_result_t result;
+    esp_err_t          res;
+} server_run_t;
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s server|client HOST|loopback [-m tcp|udp|rtt] [-p port] [-t seconds] [-l bytes] [-b kbps] [-n count] [-i ms]\n", name);
+}
+
+static void print_result(const net_bench_result_t* result) {
+    char json[512];
+    net_bench_format_json(result, json, sizeof(json));
+    printf("%s\n", json);
+    fflush(stdout);
+}
+
+static void* server_thread(void* arg) {
+    server_run_t* run = arg;
+    run->res = net_bench_server(&run->config, &run->result);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    net_bench_config_t config;
+    net_bench_default_config(&config);
+
+    const char* command = argv[1];
+    int         first   = 2;
+    if (strcmp(command, "client") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return 2;
+        }
+        config.host = argv[2];
+        first       = 3;
+    } else if (strcmp(command, "loopback") == 0) {
+        config.host = "127.0.0.1";
+    } else if (strcmp(command, "server") != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    bool size_set = false;
+    int  option;
+    optind = first;
+    while ((option = getopt(argc, argv, "m:p:t:l:b:n:i:")) != -1) {
+        switch (option) {
+            case 'm':
+                if (strcmp(optarg, "tcp") == 0) {
+                    config.mode = NET_BENCH_TCP;
+                } else if (strcmp(optarg, "udp") == 0) {
+                    config.mode = NET_BENCH_UDP;
+                } else if (strcmp(optarg, "rtt") == 0) {
+                    config.mode = NET_BENCH_RTT;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'p': config.port = atoi(optarg); break;
+            case 't': config.duration_ms = atof(optarg) * 1000; break;
+            case 'l': config.size = atoi(optarg); size_set = true; break;
+            case 'b': config.rate_kbps = atoi(optarg); break;
+            case 'n': config.count = atoi(optarg); break;
+            case 'i': config.interval_ms = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (!size_set && config.mode != NET_BENCH_TCP) config.size = NET_BENCH_UDP_SIZE;
+
+    if (strcmp(command, "server") == 0) {
+        for (;;) {
+            net_bench_result_t result;
+            if (net_bench_server(&config, &result) == ESP_OK) print_result(&result);
+        }
+    }
+
+    net_bench_result_t result;
+    if (strcmp(command, "client") == 0) {
+        esp_err_t res = net_bench_client(&config, &result);
+        if (res != ESP_OK) return 1;
+        print_result(&result);
+        return 0;
+    }
+
+    // Loopback: the client retries connecting, so the server doesn't need to be listening yet.
+    server_run_t server = {.config = config};
+    pthread_t    thread;
+    if (pthread_create(&thread, NULL, server_thread, &server) != 0) return 1;
+    if (net_bench_client(&config, &result) != ESP_OK) return 1;
+    pthread_join(thread, NULL);
+    if (server.res != ESP_OK) return 1;
+    print_result(&server.result);
+    print_result(&result);
+    return 0;
+}
@@ -1,103 +1,607 @@
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sdkconfig.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
+#include <freertos/event_groups.h>
 #include <esp_system.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 #include <nvs.h>
 #include "wifi_connection.h"
 #include "wifi_connect.h"
+#include "bsp_tasks.h"
 
 static const char *TAG = "wifi_connect";
 
-bool wifi_connect_to_stored() {
-    bool result = false;
-    // Open NVS.
-    nvs_handle_t handle;
-    nvs_open("system", NVS_READWRITE, &handle);
-    wifi_auth_mode_t authmode = 0;
-    esp_eap_ttls_phase2_types phase2 = 0;
-    char *ssid = NULL;
-    char *ident = NULL;
-    char *anon_ident = NULL;
-    char *password = NULL;
+// Retries after a connection to a stored network is lost, as `wifi_connect` callers used to pass.
+#define WIFI_CONNECT_RECONNECT_RETRIES 3
+
+// Version of the stored WiFi configuration layout.
+#define WIFI_CONFIG_VERSION 1
+
+// The WiFi configuration as stored in the "wifi.config" blob.
+// Only the first `count` networks are stored.
+typedef struct {
+    uint8_t               version;
+    uint8_t               count;
+    uint16_t              network_size;  // sizeof(wifi_stored_network_t), catches layout changes.
+    uint32_t              legacy_sum;    // Checksum of the SSID and password in the legacy `wifi.*` keys when last synced.
+    wifi_stored_network_t networks[WIFI_MAX_STORED_NETWORKS];
+} wifi_config_blob_t;
+
+// A stored network that is visible in the scan results.
+typedef struct {
+    wifi_stored_network_t* network;
+    size_t                 index;  // Index into the list of stored networks.
+    wifi_ap_record_t       ap;
+} wifi_candidate_t;
+
+// Size of the stored blob.
+static size_t wifi_config_size(size_t count) {
+    return offsetof(wifi_config_blob_t, networks) + count * sizeof(wifi_stored_network_t);
+}
+
+// Read the network stored in the legacy `wifi.*` keys, which other apps still read and write.
+static esp_err_t wifi_load_legacy_network(nvs_handle_t handle, wifi_stored_network_t *network) {
+    memset(network, 0, sizeof(*network));
     size_t len;
-    
-    // Read NVS.
     esp_err_t res;
-    res = nvs_get_str(handle, "wifi.ssid", NULL, &len);
-    if (res) goto errcheck;
-    ssid = malloc(len);
-    res = nvs_get_str(handle, "wifi.ssid", ssid, &len);
-    if (res) goto errcheck;
+    
+    len = sizeof(network->ssid);
+    res = nvs_get_str(handle, "wifi.ssid", network->ssid, &len);
+    if (res) return res;
     
     // Check whether connection is enterprise.
-    res = nvs_get_u8(handle, "wifi.authmode", &authmode);
-    bool use_ent = authmode == WIFI_AUTH_WPA2_ENTERPRISE;
-    if (res) goto errcheck;
+    res = nvs_get_u8(handle, "wifi.authmode", &network->authmode);
+    if (res) return res;
     
-    if (use_ent) {
+    if (network->authmode == WIFI_AUTH_WPA2_ENTERPRISE) {
         // Read enterprise-specific parameters.
+        res = nvs_get_u8(handle, "wifi.phase2", &network->phase2);
+        if (res) return res;
         
-        // Read phase2 mode.
-        res = nvs_get_u8(handle, "wifi.phase2", &phase2);
-        if (res) goto errcheck;
-        
-        // Read identity.
-        res = nvs_get_str(handle, "wifi.username", NULL, &len);
-        if (res) goto errcheck;
-        ident = malloc(len);
-        res = nvs_get_str(handle, "wifi.username", ident, &len);
+        len = sizeof(network->ident);
+        res = nvs_get_str(handle, "wifi.username", network->ident, &len);
+        if (res) return res;
         
-        // Read anonymous identity.
-        res = nvs_get_str(handle, "wifi.anon_ident", NULL, &len);
+        len = sizeof(network->anon_ident);
+        res = nvs_get_str(handle, "wifi.anon_ident", network->anon_ident, &len);
         if (res == ESP_ERR_NVS_NOT_FOUND) {
             // Default is use the same thing.
-            anon_ident = strdup(ident);
-        } else {
-            if (res) goto errcheck;
-            anon_ident = malloc(len);
-            res = nvs_get_str(handle, "wifi.anon_ident", anon_ident, &len);
-            if (res) goto errcheck;
+            strcpy(network->anon_ident, network->ident);
+        } else if (res) {
+            return res;
         }
     }
-    res = nvs_get_str(handle, "wifi.password", NULL, &len);
-    if (res) goto errcheck;
-    password = malloc(len);
-    res = nvs_get_str(handle, "wifi.password", password, &len);
-    if (res) goto errcheck;
+    
+    len = sizeof(network->password);
+    res = nvs_get_str(handle, "wifi.password", network->password, &len);
+    if (res) return res;
+    
+    return ESP_OK;
+}
+
+// Add a network to the configuration, replacing the one with the same SSID if any.
+// The network is put first so it is tried first when it has no connection history.
+static bool wifi_config_upsert(wifi_config_blob_t *config, const wifi_stored_network_t *network) {
+    size_t index = config->count;
+    for (size_t i = 0; i < config->count; i++) {
+        if (!strcmp(config->networks[i].ssid, network->ssid)) index = i;
+    }
+    if (index == config->count) {
+        if (config->count >= WIFI_MAX_STORED_NETWORKS) return false;
+        config->count++;
+    }
+    memmove(&config->networks[1], &config->networks[0], index * sizeof(wifi_stored_network_t));
+    config->networks[0] = *network;
+    return true;
+}
+
+// Checksum of a legacy SSID and password, to notice when other apps change them (FNV-1a).
+static uint32_t wifi_legacy_checksum(const char *ssid, const char *password) {
+    const char *fields[] = {ssid, password};
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        for (const char *c = fields[i]; ; c++) {
+            hash = (hash ^ (uint8_t) *c) * 16777619u;
+            if (!*c) break;
+        }
+    }
+    return hash;
+}
+
+// Whether another app changed the legacy `wifi.*` keys since they were last synced.
+// Apps that configure a network always set the SSID and password, so only those two keys are read.
+static bool wifi_config_legacy_changed(nvs_handle_t handle, const wifi_config_blob_t *config) {
+    char   ssid[33];
+    char   password[129];
+    size_t len = sizeof(ssid);
+    if (nvs_get_str(handle, "wifi.ssid", ssid, &len) != ESP_OK) return false;
+    len = sizeof(password);
+    if (nvs_get_str(handle, "wifi.password", password, &len) != ESP_OK) return false;
+    bool changed = wifi_legacy_checksum(ssid, password) != config->legacy_sum;
+    // Don't leave credentials lying around on the stack.
+    memset(password, 0, sizeof(password));
+    return changed;
+}
+
+// Pick up the network in the legacy `wifi.*` keys, which another app changed since they were last synced.
+// The keys are left alone, the launcher and older apps keep using them.
+// Returns whether the configuration changed.
+static bool wifi_config_import_legacy(nvs_handle_t handle, wifi_config_blob_t *config) {
+    bool imported = false;
+    wifi_stored_network_t *network = malloc(sizeof(wifi_stored_network_t));
+    if (!network) return false;
+    
+    if (wifi_load_legacy_network(handle, network) == ESP_OK) {
+        ESP_LOGI(TAG, "Importing WiFi network '%s'", network->ssid);
+        // Keep what we learned about a network that was stored already.
+        for (size_t i = 0; i < config->count; i++) {
+            if (strcmp(config->networks[i].ssid, network->ssid)) continue;
+            memcpy(network->bssid, config->networks[i].bssid, sizeof(network->bssid));
+            network->channel      = config->networks[i].channel;
+            network->ap_authmode  = config->networks[i].ap_authmode;
+            network->last_success = config->networks[i].last_success;
+        }
+        if (!wifi_config_upsert(config, network)) {
+            // Make room by dropping the network that worked least recently.
+            size_t oldest = 0;
+            for (size_t i = 1; i < config->count; i++) {
+                if (config->networks[i].last_success < config->networks[oldest].last_success) oldest = i;
+            }
+            config->count--;
+            memmove(&config->networks[oldest], &config->networks[oldest + 1], (config->count - oldest) * sizeof(wifi_stored_network_t));
+            wifi_config_upsert(config, network);
+        }
+        imported = true;
+    }
+    
+    // Don't leave credentials lying around on the heap.
+    memset(network, 0, sizeof(*network));
+    free(network);
+    return imported;
+}
+
+// Write the first network to the legacy `wifi.*` keys so the launcher and older apps use it too.
+static esp_err_t wifi_config_sync_legacy(nvs_handle_t handle, const wifi_stored_network_t *network) {
+    esp_err_t res = nvs_set_str(handle, "wifi.ssid", network->ssid);
+    if (res == ESP_OK) res = nvs_set_str(handle, "wifi.password", network->password);
+    if (res == ESP_OK) res = nvs_set_u8(handle, "wifi.authmode", network->authmode);
+    if (res == ESP_OK && network->authmode == WIFI_AUTH_WPA2_ENTERPRISE) {
+        res = nvs_set_u8(handle, "wifi.phase2", network->phase2);
+        if (res == ESP_OK) res = nvs_set_str(handle, "wifi.username", network->ident);
+        if (res == ESP_OK) res = nvs_set_str(handle, "wifi.anon_ident", network->anon_ident);
+    }
+    return res;
+}
 
+// Write the configuration blob and the legacy keys together, so loading only has to compare the checksum.
+static esp_err_t wifi_config_write(nvs_handle_t handle, wifi_config_blob_t *config) {
+    config->version      = WIFI_CONFIG_VERSION;
+    config->network_size = sizeof(wifi_stored_network_t);
+    esp_err_t res = ESP_OK;
+    if (config->count) {
+        res = wifi_config_sync_legacy(handle, &config->networks[0]);
+        config->legacy_sum = wifi_legacy_checksum(config->networks[0].ssid, config->networks[0].password);
+    }
+    if (res == ESP_OK) res = nvs_set_blob(handle, "wifi.config", config, wifi_config_size(config->count));
+    if (res == ESP_OK) res = nvs_commit(handle);
+    return res;
+}
+
+// Write the WiFi configuration.
+static esp_err_t wifi_config_save(wifi_config_blob_t *config) {
+    nvs_handle_t handle;
+    esp_err_t res = nvs_open("system", NVS_READWRITE, &handle);
+    if (res) return res;
+    res = wifi_config_write(handle, config);
     nvs_close(handle);
+    return res;
+}
+
+// Read the WiFi configuration from its blob, importing the legacy keys if another app changed them.
+// Besides the blob only the legacy SSID and password are read, unless there is something to import.
+static esp_err_t wifi_config_load(wifi_config_blob_t *config) {
+    memset(config, 0, sizeof(*config));
+    nvs_handle_t handle;
+    esp_err_t res = nvs_open("system", NVS_READONLY, &handle);
+    if (res == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;  // Nothing was ever stored.
+    if (res) return res;
+    
+    size_t len = sizeof(*config);
+    res = nvs_get_blob(handle, "wifi.config", config, &len);
+    if (res == ESP_OK && (config->version != WIFI_CONFIG_VERSION || config->network_size != sizeof(wifi_stored_network_t) ||
+                          config->count > WIFI_MAX_STORED_NETWORKS || len != wifi_config_size(config->count))) {
+        ESP_LOGE(TAG, "Unsupported WiFi configuration version %d", config->version);
+        memset(config, 0, sizeof(*config));
+    } else if (res != ESP_OK && res != ESP_ERR_NVS_NOT_FOUND) {
+        // Includes ESP_ERR_NVS_INVALID_LENGTH for blobs that don't fit.
+        ESP_LOGE(TAG, "Failed to read WiFi configuration: %s", esp_err_to_name(res));
+        memset(config, 0, sizeof(*config));
+    }
+    
+    bool imported = wifi_config_legacy_changed(handle, config) && wifi_config_import_legacy(handle, config);
+    nvs_close(handle);
+    // Only open for writing when there is something to write.
+    return imported ? wifi_config_save(config) : ESP_OK;
+}
+
+// Allocates the configuration, it's a few KiB which is too much for most task stacks.
+static wifi_config_blob_t *wifi_config_alloc() {
+    return calloc(1, sizeof(wifi_config_blob_t));
+}
+
+// Frees the configuration without leaving credentials on the heap.
+static void wifi_config_free(wifi_config_blob_t *config) {
+    memset(config, 0, sizeof(*config));
+    free(config);
+}
+
+size_t wifi_get_stored_networks(wifi_stored_network_t *networks, size_t max_networks) {
+    wifi_config_blob_t *config = wifi_config_alloc();
+    if (!config) return 0;
+    size_t count = 0;
+    if (wifi_config_load(config) == ESP_OK) {
+        count = config->count < max_networks ? config->count : max_networks;
+        memcpy(networks, config->networks, count * sizeof(wifi_stored_network_t));
+    }
+    wifi_config_free(config);
+    return count;
+}
+
+esp_err_t wifi_store_network(const wifi_stored_network_t *network) {
+    wifi_config_blob_t *config = wifi_config_alloc();
+    if (!config) return ESP_ERR_NO_MEM;
+    esp_err_t res = wifi_config_load(config);
+    if (res == ESP_OK) {
+        res = wifi_config_upsert(config, network) ? wifi_config_save(config) : ESP_ERR_NO_MEM;
+    }
+    wifi_config_free(config);
+    return res;
+}
+
+esp_err_t wifi_forget_network(const char *ssid) {
+    wifi_config_blob_t *config = wifi_config_alloc();
+    if (!config) return ESP_ERR_NO_MEM;
+    esp_err_t res = wifi_config_load(config);
+    if (res == ESP_OK) {
+        res = ESP_ERR_NOT_FOUND;
+        for (size_t i = 0; i < config->count; i++) {
+            if (strcmp(config->networks[i].ssid, ssid)) continue;
+            config->count--;
+            memmove(&config->networks[i], &config->networks[i + 1], (config->count - i) * sizeof(wifi_stored_network_t));
+            res = wifi_config_save(config);
+            break;
+        }
+    }
+    wifi_config_free(config);
+    return res;
+}
+
+// Remember the AP we just connected to for the next time.
+static void wifi_update_network(wifi_config_blob_t *config, size_t index) {
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+    
+    wifi_stored_network_t *network = &config->networks[index];
+    wifi_stored_network_t old = *network;
+    memcpy(network->bssid, ap_info.bssid, sizeof(network->bssid));
+    network->channel     = ap_info.primary;
+    network->ap_authmode = ap_info.authmode;
+    uint32_t last = 0;
+    for (size_t i = 0; i < config->count; i++) {
+        if (config->networks[i].last_success > last) last = config->networks[i].last_success;
+    }
+    if (network->last_success != last || !last) network->last_success = last + 1;
+    // Only write when changed to spare the flash.
+    if (!memcmp(&old, network, sizeof(old))) return;
     
-    // Open the appropriate connection.
-    if (use_ent) {
-        result = wifi_connect_ent(ssid, ident, anon_ident, password, phase2, 3);
+    esp_err_t res = wifi_config_save(config);
+    if (res) ESP_LOGW(TAG, "Failed to store fast connect info: %s", esp_err_to_name(res));
+}
+
+// Bits of `connectEvents`.
+#define WIFI_CONNECT_ASSOCIATED_BIT BIT0  // The current attempt associated with an AP.
+#define WIFI_CONNECT_GOT_IP_BIT     BIT1  // The current attempt connected.
+#define WIFI_CONNECT_FAILED_BIT     BIT2  // The current attempt failed.
+#define WIFI_CONNECT_CANCEL_BIT     BIT3  // `wifi_connect_to_stored_cancel` was called.
+#define WIFI_CONNECT_DONE_BIT       BIT4  // The connect task finished.
+#define WIFI_CONNECT_SUCCESS_BIT    BIT5  // The connect task finished connected, set together with the done bit.
+
+// The connection to a stored network being made, there is one at a time.
+static EventGroupHandle_t         connectEvents   = NULL;
+static portMUX_TYPE               connectLock     = portMUX_INITIALIZER_UNLOCKED;
+static bool                       connectBusy     = false;
+static wifi_connect_progress_cb_t connectCallback = NULL;
+static void*                      connectCtx      = NULL;
+static int64_t                    connectStart    = 0;
+static int64_t                    connectDeadline = 0;  // esp_timer time to give up at, 0 for never.
+
+// Reports progress to the callback, if any.
+static void wifi_connect_report(wifi_connect_stage_t stage, const char *ssid) {
+    if (!connectCallback) return;
+    wifi_connect_progress_t progress = {
+        .stage      = stage,
+        .ssid       = ssid,
+        .elapsed_ms = (esp_timer_get_time() - connectStart) / 1000,
+    };
+    connectCallback(&progress, connectCtx);
+}
+
+// Whether the connection was cancelled or timed out.
+static bool wifi_connect_stopped() {
+    if (xEventGroupGetBits(connectEvents) & WIFI_CONNECT_CANCEL_BIT) return true;
+    return connectDeadline && esp_timer_get_time() >= connectDeadline;
+}
+
+// Turns connection events into `connectEvents` bits for the connect task.
+static void wifi_connect_event(const wifi_connection_event_t *event, void *ctx) {
+    if (event->id == WIFI_CONNECTION_EVENT_ASSOCIATED) {
+        xEventGroupSetBits(connectEvents, WIFI_CONNECT_ASSOCIATED_BIT);
+    } else if (event->id == WIFI_CONNECTION_EVENT_CONNECTED) {
+        xEventGroupSetBits(connectEvents, WIFI_CONNECT_GOT_IP_BIT);
+    } else if (event->id == WIFI_CONNECTION_EVENT_DISCONNECTED && !event->retrying) {
+        xEventGroupSetBits(connectEvents, WIFI_CONNECT_FAILED_BIT);
+    }
+}
+
+// Waits for the current attempt to connect or fail, or for the connection to be stopped.
+static bool wifi_connect_wait(const char *ssid) {
+    // Whether the event loop took on this attempt, so IDLE or FAILED means the attempt ended.
+    bool handled = false;
+    while (!wifi_connect_stopped()) {
+        // Wake up now and then in case an event was dropped.
+        TickType_t ticks = pdMS_TO_TICKS(1000);
+        if (connectDeadline) {
+            int64_t left = connectDeadline - esp_timer_get_time();
+            if (left < 1000000) ticks = pdMS_TO_TICKS(left / 1000) + 1;
+        }
+        EventBits_t bits = xEventGroupWaitBits(connectEvents, WIFI_CONNECT_ASSOCIATED_BIT | WIFI_CONNECT_GOT_IP_BIT |
+                                               WIFI_CONNECT_FAILED_BIT | WIFI_CONNECT_CANCEL_BIT, pdFALSE, pdFALSE, ticks);
+        if (bits & WIFI_CONNECT_GOT_IP_BIT || wifi_is_connected()) return true;
+        if (bits & (WIFI_CONNECT_FAILED_BIT | WIFI_CONNECT_CANCEL_BIT)) return false;
+        if (bits & WIFI_CONNECT_ASSOCIATED_BIT) {
+            xEventGroupClearBits(connectEvents, WIFI_CONNECT_ASSOCIATED_BIT);
+            wifi_connect_report(WIFI_CONNECT_STAGE_DHCP, ssid);
+        }
+        
+        // Notice a failure whose event was dropped.
+        wifi_connection_status_t status;
+        wifi_get_status(&status);
+        bool ended = status.state == WIFI_STATE_IDLE || status.state == WIFI_STATE_FAILED;
+        if (ended && handled) return false;
+        // The connect command is handled long before the next wake up, or already was if the attempt got anywhere.
+        handled = true;
+    }
+    return false;
+}
+
+// Connect to a stored network and wait for the result.
+static bool wifi_connect_network(const wifi_stored_network_t *network, wifi_auth_mode_t ap_authmode, uint8_t retries) {
+    if (wifi_connect_stopped()) return false;
+    xEventGroupClearBits(connectEvents, WIFI_CONNECT_ASSOCIATED_BIT | WIFI_CONNECT_GOT_IP_BIT | WIFI_CONNECT_FAILED_BIT);
+    wifi_connect_report(WIFI_CONNECT_STAGE_ASSOCIATING, network->ssid);
+    // `retries` only limits getting connected, once up the connection reconnects like any other.
+    wifi_set_reconnect_retries(WIFI_CONNECT_RECONNECT_RETRIES);
+    if (network->authmode == WIFI_AUTH_WPA2_ENTERPRISE) {
+        wifi_connect_ent_async(network->ssid, network->ident, network->anon_ident, network->password, network->phase2, retries);
     } else {
-        result = wifi_connect(ssid, password, authmode, 3);
+        wifi_connect_async(network->ssid, network->password, ap_authmode > network->authmode ? ap_authmode : network->authmode, retries);
     }
+    return wifi_connect_wait(network->ssid);
+}
+
+// Ranks candidates by signal strength, then security, then how recently they worked, then exact RSSI.
+static int wifi_candidate_cmp(const void *a, const void *b) {
+    const wifi_candidate_t *ca = a;
+    const wifi_candidate_t *cb = b;
+    int diff = (int) wifi_rssi_to_strength(cb->ap.rssi) - (int) wifi_rssi_to_strength(ca->ap.rssi);
+    if (diff) return diff;
+    diff = (int) (cb->ap.authmode != WIFI_AUTH_OPEN) - (int) (ca->ap.authmode != WIFI_AUTH_OPEN);
+    if (diff) return diff;
+    if (cb->network->last_success != ca->network->last_success) return cb->network->last_success > ca->network->last_success ? 1 : -1;
+    return cb->ap.rssi - ca->ap.rssi;
+}
+
+// Connect to the best stored network visible in a single scan.
+static bool wifi_connect_best(wifi_config_blob_t *config) {
+    wifi_stored_network_t *networks = config->networks;
+    size_t count = config->count;
+    bool result = false;
+    const wifi_ap_record_t *aps = NULL;
+    if (wifi_connect_stopped()) return false;
+    wifi_connect_report(WIFI_CONNECT_STAGE_SCANNING, NULL);
+    // Cancelling or timing out takes effect once this scan is done.
+    wifi_scan(NULL);
+    size_t num_aps = wifi_scan_get_results(&aps);
+    
+    // Find the strongest AP of every stored network, scan results are sorted strongest first.
+    wifi_candidate_t candidates[WIFI_MAX_STORED_NETWORKS];
+    size_t num_candidates = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < num_aps; j++) {
+            if (strncmp((const char *) aps[j].ssid, networks[i].ssid, sizeof(aps[j].ssid))) continue;
+            candidates[num_candidates].network = &networks[i];
+            candidates[num_candidates].index   = i;
+            candidates[num_candidates].ap      = aps[j];
+            num_candidates++;
+            break;
+        }
+    }
+    wifi_scan_release_results();
+    qsort(candidates, num_candidates, sizeof(wifi_candidate_t), wifi_candidate_cmp);
     
-    errcheck:
-    if (res == ESP_ERR_NVS_NOT_FOUND || res == ESP_ERR_NVS_NOT_INITIALIZED) {
+    for (size_t i = 0; i < num_candidates && !result; i++) {
+        wifi_candidate_t *candidate = &candidates[i];
+        ESP_LOGI(TAG, "Connecting to '%s' (rssi=%d, channel %d)", candidate->network->ssid, candidate->ap.rssi, candidate->ap.primary);
+        wifi_set_connect_hint(candidate->ap.bssid, candidate->ap.primary);
+        result = wifi_connect_network(candidate->network, candidate->ap.authmode, 1);
+        if (result) wifi_update_network(config, candidate->index);
+    }
+    
+    if (!num_candidates) {
+        // None of them are visible, they might be hidden: try each with a full scan.
+        for (size_t i = 0; i < count && !result; i++) {
+            result = wifi_connect_network(&networks[i], networks[i].authmode, 3);
+            if (result) wifi_update_network(config, i);
+        }
+    }
+    return result;
+}
+
+// Connects to the best stored network, run by the connect task.
+static bool wifi_connect_stored_run() {
+    bool result = false;
+    wifi_config_blob_t *config = wifi_config_alloc();
+    if (!config) {
+        ESP_LOGE(TAG, "Out of memory");
+        return false;
+    }
+    
+    // Read NVS.
+    wifi_connect_report(WIFI_CONNECT_STAGE_READING_CONFIG, NULL);
+    esp_err_t res = wifi_config_load(config);
+    if (res || !config->count) {
         ESP_LOGE(TAG, "Failed to read WiFi configuration from NVS");
-    } else if (res) {
-        // Other errors.
-        ESP_LOGE(TAG, "Error connecting to WiFi: %s", esp_err_to_name(res));
+        wifi_config_free(config);
+        return false;
+    }
+    wifi_stored_network_t *networks = config->networks;
+    size_t count = config->count;
+    
+    // Find the network that worked most recently.
+    wifi_stored_network_t *last = NULL;
+    size_t last_index = 0;
+    for (size_t i = 0; i < count; i++) {
+        wifi_scan_add_known_channel(networks[i].channel);
+        if (networks[i].channel && (!last || networks[i].last_success > last->last_success)) {
+            last       = &networks[i];
+            last_index = i;
+        }
+    }
+    
+    if (last) {
+        // Try its AP from last time on its own channel first, skipping the full scan.
+        ESP_LOGI(TAG, "Trying fast reconnect to '%s' on channel %d", last->ssid, last->channel);
+        wifi_set_connect_hint(last->bssid, last->channel);
+        result = wifi_connect_network(last, last->ap_authmode, 0);
+        if (result) {
+            wifi_update_network(config, last_index);
+        } else {
+            ESP_LOGI(TAG, "Fast reconnect failed, falling back to scan");
+        }
     }
     
-    // Free memory.
-    if (ssid) free(ssid);
-    if (ident) free(ident);
-    if (anon_ident) free(anon_ident);
-    if (password) free(password);
+    if (!result) result = wifi_connect_best(config);
     
+    wifi_config_free(config);
     return result;
 }
 
+// Makes the connection started by `wifi_connect_to_stored_async`.
+static void wifi_connect_task(void *arg) {
+    // Keep the driver running between the attempts.
+    bool claimed = wifi_start() == ESP_OK;
+    bool result  = claimed && wifi_connect_stored_run();
+    wifi_unsubscribe(wifi_connect_event, NULL);
+    
+    // Only undo this task's own `wifi_start`, the app may keep the driver running as well.
+    // Once connected the driver runs for the connection, like any other.
+    if (claimed) wifi_stop();
+    wifi_connect_stage_t stage = WIFI_CONNECT_STAGE_CONNECTED;
+    if (!result) {
+        stage = xEventGroupGetBits(connectEvents) & WIFI_CONNECT_CANCEL_BIT ? WIFI_CONNECT_STAGE_CANCELLED :
+                connectDeadline && esp_timer_get_time() >= connectDeadline ? WIFI_CONNECT_STAGE_TIMEOUT : WIFI_CONNECT_STAGE_FAILED;
+        // Stop the attempt in progress, if any, which turns the radio off unless the app started it.
+        wifi_abort_connect();
+    }
+    wifi_connect_report(stage, NULL);
+    
+    // Report the result before releasing the run, so it lands before a new run clears it.
+    xEventGroupSetBits(connectEvents, WIFI_CONNECT_DONE_BIT | (result ? WIFI_CONNECT_SUCCESS_BIT : 0));
+    portENTER_CRITICAL(&connectLock);
+    connectBusy = false;
+    portEXIT_CRITICAL(&connectLock);
+    bsp_task_exit(BSP_TASK_WIFI_CONNECT);
+}
+
+esp_err_t wifi_connect_to_stored_async(wifi_connect_progress_cb_t callback, void *ctx, uint32_t timeout_ms) {
+    // Created before claiming `connectBusy`, so callers that find it taken can always wait on it.
+    if (!connectEvents) {
+        EventGroupHandle_t events = xEventGroupCreate();
+        if (!events) return ESP_ERR_NO_MEM;
+        portENTER_CRITICAL(&connectLock);
+        if (!connectEvents) {
+            connectEvents = events;
+            events        = NULL;
+        }
+        portEXIT_CRITICAL(&connectLock);
+        if (events) vEventGroupDelete(events);
+    }
+    
+    // Forget the previous run together with claiming, so waiters never see its result.
+    portENTER_CRITICAL(&connectLock);
+    bool busy = connectBusy;
+    if (!busy) {
+        connectBusy = true;
+        xEventGroupClearBits(connectEvents, 0xFF);
+    }
+    portEXIT_CRITICAL(&connectLock);
+    if (busy) return ESP_ERR_INVALID_STATE;
+    
+    connectCallback = callback;
+    connectCtx      = ctx;
+    connectStart    = esp_timer_get_time();
+    connectDeadline = timeout_ms ? connectStart + (int64_t) timeout_ms * 1000 : 0;
+    
+    esp_err_t res = wifi_subscribe(wifi_connect_event, NULL);
+    if (res) goto error;
+    if (bsp_task_create(BSP_TASK_WIFI_CONNECT, wifi_connect_task, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the connect task");
+        wifi_unsubscribe(wifi_connect_event, NULL);
+        res = ESP_ERR_NO_MEM;
+        goto error;
+    }
+    return ESP_OK;
+    
+    error:
+    // Release callers that started waiting for this run.
+    xEventGroupSetBits(connectEvents, WIFI_CONNECT_DONE_BIT);
+    portENTER_CRITICAL(&connectLock);
+    connectBusy = false;
+    portEXIT_CRITICAL(&connectLock);
+    return res;
+}
+
+void wifi_connect_to_stored_cancel() {
+    portENTER_CRITICAL(&connectLock);
+    bool busy = connectBusy;
+    portEXIT_CRITICAL(&connectLock);
+    if (busy) xEventGroupSetBits(connectEvents, WIFI_CONNECT_CANCEL_BIT);
+}
+
+bool wifi_connect_to_stored() {
+    // Same as the background connection, so the NVS reads and scans happen on the connect task either way.
+    esp_err_t res = wifi_connect_to_stored_async(NULL, NULL, 0);
+    // If a connection is being made already, wait for that one instead.
+    if (res != ESP_OK && res != ESP_ERR_INVALID_STATE) return false;
+    // The result comes with the done bit, a run claimed right after clears both.
+    EventBits_t bits = xEventGroupWaitBits(connectEvents, WIFI_CONNECT_DONE_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+    return bits & WIFI_CONNECT_SUCCESS_BIT;
+}
+
+esp_err_t wifi_connect_to_stored_background() {
+    wifi_init();
+    return wifi_connect_to_stored_async(NULL, NULL, 0);
+}
+
 void wifi_disconnect_and_disable() {
-    esp_wifi_disconnect();
-    esp_wifi_stop();
+    // Also stops reconnecting and lets the driver stop after failed attempts again.
+    wifi_disconnect();
 }
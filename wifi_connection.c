@@ -1,14 +1,25 @@
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
 #include "wifi_connection.h"
+#include "bsp_tasks.h"
+
+#ifdef CONFIG_WPA_11KV_SUPPORT
+#include "esp_rrm.h"
+#include "esp_wnm.h"
+#endif
 
 static const char *TAG = "wifi_connection";
 
@@ -18,59 +29,840 @@ static const char *TAG = "wifi_connection";
 
 static EventGroupHandle_t wifiEventGroup;
 
-static uint8_t retryCount = 0;
-static uint8_t maxRetries = 3;
-static bool isScanning = false;
+// Connection state machine.
+// Only the event loop task changes the state, other tasks post commands to it and read snapshots.
+// The exception is `scanning`, which scans claim and release directly because they need the answer.
+ESP_EVENT_DEFINE_BASE(WIFI_CONNECTION_CMD);
+enum {
+    WIFI_CMD_CONNECT,     // A connection was configured, data is a wifi_connect_cmd_t.
+    WIFI_CMD_DISCONNECT,  // Stop connecting and don't reconnect.
+    WIFI_CMD_RECONNECT,   // The backoff delay has passed.
+    WIFI_CMD_SCAN_END,    // A scan that deferred a connection attempt finished.
+    WIFI_CMD_LINK_CHECK,  // Time to check the signal of the current AP.
+};
+typedef struct {
+    uint8_t max_retries;        // Until connected.
+    uint8_t reconnect_retries;  // After losing the connection.
+    bool    restart;            // Whether the station is about to be (re)started, otherwise it is running already.
+    bool    pinned;             // Whether the config is locked to the BSSID and channel of the connect hint.
+} wifi_connect_cmd_t;
+static wifi_connection_status_t status = {
+    .state       = WIFI_STATE_IDLE,
+    .max_retries = 3,
+};
+static bool         connectPending   = false;  // A connection attempt waits for a scan to finish.
+static uint8_t      reconnectRetries = 3;      // Replaces `status.max_retries` once connected.
+static portMUX_TYPE statusLock       = portMUX_INITIALIZER_UNLOCKED;
+
+// Roaming between APs of the same network, owned by the event loop task like the state.
+typedef enum {
+    WIFI_ROAM_IDLE,
+    WIFI_ROAM_SCANNING,  // Looking for a better AP.
+    WIFI_ROAM_LEAVING,   // Disconnecting from the current AP.
+    WIFI_ROAM_JOINING,   // Associating with the better AP.
+} wifi_roam_state_t;
+static wifi_roam_config_t roamConfig = {
+    .enabled          = true,
+    .rssi_threshold   = WIFI_ROAM_RSSI_THRESHOLD,
+    .hysteresis       = WIFI_ROAM_HYSTERESIS,
+    .scan_interval_ms = WIFI_ROAM_SCAN_INTERVAL_MS,
+};
+static wifi_roam_state_t  roamState    = WIFI_ROAM_IDLE;
+static bool               roamPinned   = false;  // Whether the station config is locked to one AP: the roaming target or the connect hint.
+static uint8_t            roamBssid[6];
+static uint8_t            roamChannel  = 0;
+static int64_t            roamScanTime = 0;  // esp_timer time of the last roaming scan, 0 if none.
+static esp_timer_handle_t linkTimer    = NULL;  // Periodic signal checks while connected.
+static int8_t             linkRssi     = 0;     // RSSI last reported to subscribers.
+
+// Event subscriptions, delivered by the dispatcher task.
+typedef struct {
+    wifi_connection_event_cb_t callback;
+    void*                      ctx;
+    QueueHandle_t              queue;
+} wifi_subscriber_t;
+static wifi_subscriber_t subscribers[WIFI_MAX_SUBSCRIBERS];
+static SemaphoreHandle_t subscribersMutex = NULL;
+static QueueHandle_t     eventQueue       = NULL;  // Created with the dispatcher task on the first subscription.
+
+// Identifies the enterprise network and credentials enabled in the driver, so connecting to
+// the same network again can keep the driver's PMK cache instead of doing the full EAP exchange.
+static bool     entEnabled  = false;
+static uint32_t entConfigId = 0;
+
+// Serializes connect, disconnect and scan calls from different tasks.
+static SemaphoreHandle_t apiMutex = NULL;
+
+// Whether `wifi_init` or `wifi_init_no_hardware` ran.
+static bool wifiInitialised = false;
+
+// Number of `wifi_start` calls not undone by `wifi_stop` yet, the driver keeps running between
+// connection attempts and scans while it's not 0.
+static uint8_t keepStarted = 0;
+
+// Timing of the current or last connection and aggregates over past connections.
+static wifi_connect_timing_t timing       = {0};
+static wifi_connect_stats_t  timingStats  = {0};
+static bool                  timingActive = false;
+static portMUX_TYPE          timingLock   = portMUX_INITIALIZER_UNLOCKED;
+
+// Reconnection backoff and the most recent disconnects, the history is written under statusLock.
+static esp_timer_handle_t       reconnectTimer = NULL;
+static wifi_reconnect_attempt_t reconnectHistory[WIFI_RECONNECT_HISTORY];
+static size_t                   reconnectHistoryCount = 0;
+static size_t                   reconnectHistoryNext  = 0;
+
+// Power save policy.
+static SemaphoreHandle_t powerMutex = NULL;
+static uint16_t          powerRequests[WIFI_LATENCY_COUNT] = {0};
+static wifi_latency_t    powerDefault = WIFI_LATENCY_BACKGROUND;
+static wifi_latency_t    powerLatency = WIFI_LATENCY_BACKGROUND;
+static wifi_ps_type_t    powerMode    = WIFI_PS_MIN_MODEM;  // The driver default.
+static int64_t           powerSince   = 0;  // esp_timer time the current mode was entered while started, 0 if stopped.
+static uint64_t          powerTime[3] = {0};  // Indexed by wifi_ps_type_t.
+
+// BSSID and channel to use for the next connection attempt.
+static bool    connectHintSet     = false;
+static uint8_t connectHintBssid[6];
+static uint8_t connectHintChannel = 0;
 
-static esp_netif_ip_info_t ip_info = {0};
+// Retry limit after the next connection is established, if set.
+static bool    connectReconnectSet     = false;
+static uint8_t connectReconnectRetries = 0;
+
+// With CONFIG_LWIP_DHCP_RESTORE_LAST_IP the DHCP client requests the last address it had
+// instead of discovering (INIT-REBOOT). The address is cached per AP only to tell whether it
+// was confirmed, so without the option there is nothing to cache.
+#ifdef CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+// Last DHCP address and the AP it was acquired from.
+typedef struct {
+    uint8_t        bssid[6];
+    esp_ip4_addr_t ip;
+} wifi_lease_t;
+
+static wifi_lease_t lease = {0};
+#endif
+
+static bool    leaseExpected = false;  // The DHCP client requests the cached address for this AP.
+static bool    leaseReused   = false;  // The DHCP server confirmed the cached address.
+static uint8_t connectedBssid[6];
+
+// Scan cache, kept as plain AP records so it can be handed out without copying.
+static wifi_ap_record_t  scanCache[WIFI_SCAN_CACHE_SIZE];
+static int64_t           scanCacheSeen[WIFI_SCAN_CACHE_SIZE];  // esp_timer time in microseconds.
+static size_t            scanCacheCount = 0;
+static int64_t           scanCacheTime  = 0;  // Time of the last scan, 0 if none.
+static uint32_t          scanCacheTtl   = WIFI_SCAN_CACHE_TTL_MS;
+static SemaphoreHandle_t scanCacheMutex = NULL;
+
+// Asynchronous scan state, only touched by the event handler once started.
+static bool               scanAsyncActive       = false;
+static bool               scanAsyncStopWhenDone = false;
+static wifi_scan_config_t scanAsyncConfig;
+static uint16_t           scanAsyncChannels     = 0;
+static uint8_t            scanAsyncChannel      = 0;
+static int64_t            scanAsyncStart        = 0;
+static wifi_scan_cb_t     scanAsyncCallback     = NULL;
+static void*              scanAsyncCtx          = NULL;
+
+// Records fetched from the driver after every scan, before they are merged into the cache.
+static wifi_ap_record_t scanPool[WIFI_SCAN_POOL_SIZE];
+
+// Mask of channels our networks were seen on, bit N is channel N.
+#define WIFI_SCAN_ALL_CHANNELS ((uint16_t) (((1 << WIFI_SCAN_MAX_CHANNEL) - 1) << 1))
+static uint16_t knownChannels = 0;
+
+static void wifi_scan_async_next();
+static void wifi_scan_async_cut_short();
+static void wifi_scan_async_channel_done();
+static void wifi_connect_failed(uint8_t reason);
 
 #define WIFI_SORT_ERRCHECK(err) do {int res = (err); if(res) {ESP_LOGE(TAG, "WiFi connection error: %s", esp_err_to_name(res)); goto error; } } while(0)
 
+#ifdef CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+// Load the last DHCP address from NVS.
+static void wifi_lease_load() {
+    nvs_handle_t handle;
+    if (nvs_open("system", NVS_READONLY, &handle) != ESP_OK) return;
+    size_t len = sizeof(lease);
+    if (nvs_get_blob(handle, "wifi.lease", &lease, &len) != ESP_OK || len != sizeof(lease)) {
+        memset(&lease, 0, sizeof(lease));
+    }
+    nvs_close(handle);
+}
+
+// Notes whether the DHCP client is about to confirm the cached address for this AP.
+// The client requests the last address it had, which saves the DISCOVER/OFFER round trip.
+// The server still has to acknowledge it before IP_EVENT_STA_GOT_IP, or refuse it so the
+// client starts discovering.
+static void wifi_lease_expect(const uint8_t* bssid) {
+    leaseExpected = lease.ip.addr && !memcmp(lease.bssid, bssid, sizeof(lease.bssid));
+    if (leaseExpected) ESP_LOGI(TAG, "Confirming the last DHCP address " IPSTR, IP2STR(&lease.ip));
+}
+
+// Records the address that was acquired, writing NVS only when it or the AP changed.
+// Renewals and reconnects to the same AP therefore cost no flash writes.
+static void wifi_lease_got_ip(const esp_ip4_addr_t* ip) {
+    leaseReused = leaseExpected && ip->addr == lease.ip.addr;
+    if (ip->addr == lease.ip.addr && !memcmp(lease.bssid, connectedBssid, sizeof(lease.bssid))) return;
+    memcpy(lease.bssid, connectedBssid, sizeof(lease.bssid));
+    lease.ip = *ip;
+    
+    nvs_handle_t handle;
+    if (nvs_open("system", NVS_READWRITE, &handle) != ESP_OK) return;
+    esp_err_t res = nvs_set_blob(handle, "wifi.lease", &lease, sizeof(lease));
+    if (res == ESP_OK) res = nvs_commit(handle);
+    if (res) ESP_LOGW(TAG, "Failed to store DHCP address: %s", esp_err_to_name(res));
+    nvs_close(handle);
+}
+#else
+static void wifi_lease_load() {}
+static void wifi_lease_expect(const uint8_t* bssid) {}
+static void wifi_lease_got_ip(const esp_ip4_addr_t* ip) {}
+#endif
+
+// Starts timing a new connection.
+static void wifi_timing_begin(uint8_t reason) {
+    portENTER_CRITICAL(&timingLock);
+    memset(&timing, 0, sizeof(timing));
+    timing.start_us    = esp_timer_get_time();
+    timing.last_reason = reason;
+    timingActive       = true;
+    portEXIT_CRITICAL(&timingLock);
+}
+
+// Time since the start of the current connection, 64 bits as retrying forever can take hours.
+static uint64_t wifi_timing_elapsed() {
+    return esp_timer_get_time() - timing.start_us;
+}
+
+// Adds a sample to the aggregates of a phase.
+static void wifi_timing_add(wifi_phase_stats_t* stats, uint64_t sample_us) {
+    if (!stats->count || sample_us < stats->min_us) stats->min_us = sample_us;
+    if (sample_us > stats->max_us) stats->max_us = sample_us;
+    if (!stats->count) {
+        stats->avg_us = sample_us;
+    } else {
+        // Exponential moving average so the aggregates follow changing conditions.
+        stats->avg_us += ((int64_t) sample_us - (int64_t) stats->avg_us) / WIFI_TIMING_AVG_WINDOW;
+    }
+    stats->count++;
+}
+
+// Finishes timing a connection and updates the aggregates.
+static void wifi_timing_finish() {
+    // Phases that were skipped (warm radio, reused lease) have no timestamp and are reported as 0.
+    uint64_t associate_us = 0;
+    uint64_t ip_us        = 0;
+    portENTER_CRITICAL(&timingLock);
+    timing.got_ip_us     = wifi_timing_elapsed();
+    timing.lease_reused  = leaseReused;
+    timingActive         = false;
+    if (timing.started_us) wifi_timing_add(&timingStats.radio, timing.started_us);
+    if (timing.associated_us && timing.associated_us >= timing.started_us && timing.got_ip_us >= timing.associated_us) {
+        associate_us = timing.associated_us - timing.started_us;
+        ip_us        = timing.got_ip_us - timing.associated_us;
+        wifi_timing_add(&timingStats.associate, associate_us);
+        wifi_timing_add(&timingStats.ip, ip_us);
+    }
+    wifi_timing_add(&timingStats.total, timing.got_ip_us);
+    wifi_connect_timing_t result = timing;
+    portEXIT_CRITICAL(&timingLock);
+    ESP_LOGI(TAG, "Connected in %u ms (radio %u ms, associate %u ms, IP %u ms, %d retries)",
+        (uint32_t) (result.got_ip_us / 1000), (uint32_t) (result.started_us / 1000), (uint32_t) (associate_us / 1000),
+        (uint32_t) (ip_us / 1000), result.retries);
+}
+
+// Determines how long to wait before the next connection attempt.
+static uint32_t wifi_backoff_delay(uint8_t reason, uint8_t attempt) {
+    uint32_t base = WIFI_BACKOFF_BASE_MS;
+    switch (reason) {
+        case WIFI_REASON_BEACON_TIMEOUT:
+            // Lost the AP while connected, it is probably still there: retry right away once.
+            if (attempt == 0) return 0;
+            break;
+        case WIFI_REASON_AUTH_FAIL:
+        case WIFI_REASON_AUTH_EXPIRE:
+        case WIFI_REASON_MIC_FAILURE:
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_802_1X_AUTH_FAILED:
+            // Wrong credentials or a busy authentication server, retrying quickly won't help.
+            base = WIFI_BACKOFF_AUTH_BASE_MS;
+            break;
+        default:
+            break;
+    }
+    
+    // Exponential backoff, capped.
+    uint32_t delay = WIFI_BACKOFF_MAX_MS;
+    if (attempt < 16 && (base << attempt) < WIFI_BACKOFF_MAX_MS) delay = base << attempt;
+    // Jitter between half and the full delay so badges that lost the same AP don't return in lockstep.
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+// Records a disconnect in the reconnection history.
+static void wifi_record_disconnect(uint8_t reason, uint32_t delay_ms, bool retrying) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&statusLock);
+    wifi_reconnect_attempt_t* attempt = &reconnectHistory[reconnectHistoryNext];
+    attempt->time_us  = now;
+    attempt->reason   = reason;
+    attempt->attempt  = status.retries;
+    attempt->delay_ms = delay_ms;
+    attempt->retrying = retrying;
+    reconnectHistoryNext = (reconnectHistoryNext + 1) % WIFI_RECONNECT_HISTORY;
+    if (reconnectHistoryCount < WIFI_RECONNECT_HISTORY) reconnectHistoryCount++;
+    portEXIT_CRITICAL(&statusLock);
+}
+
+// Hands an event to the dispatcher task, if anyone subscribed.
+static void wifi_publish(const wifi_connection_event_t* event) {
+    if (!eventQueue) return;
+    if (xQueueSend(eventQueue, event, 0) != pdTRUE) ESP_LOGW(TAG, "Event queue full, dropped event %d", event->id);
+}
+
+// Publishes a disconnect.
+static void wifi_publish_disconnect(uint8_t reason, bool retrying) {
+    wifi_connection_event_t event = {
+        .id       = WIFI_CONNECTION_EVENT_DISCONNECTED,
+        .reason   = reason,
+        .retrying = retrying,
+    };
+    wifi_publish(&event);
+}
+
+// Publishes the end of a scan.
+static void wifi_publish_scan_done(uint32_t duration_ms) {
+    wifi_connection_event_t event = {
+        .id          = WIFI_CONNECTION_EVENT_SCAN_DONE,
+        .num_aps     = scanCacheCount,
+        .duration_ms = duration_ms,
+    };
+    wifi_publish(&event);
+}
+
+// Delivers events to the subscribers.
+static void wifi_dispatch_task(void* arg) {
+    wifi_connection_event_t event;
+    wifi_subscriber_t       current[WIFI_MAX_SUBSCRIBERS];
+    while (1) {
+        if (xQueueReceive(eventQueue, &event, portMAX_DELAY) != pdTRUE) continue;
+        // Work on a copy so callbacks can (un)subscribe.
+        xSemaphoreTake(subscribersMutex, portMAX_DELAY);
+        memcpy(current, subscribers, sizeof(current));
+        xSemaphoreGive(subscribersMutex);
+        for (size_t i = 0; i < WIFI_MAX_SUBSCRIBERS; i++) {
+            if (current[i].callback) current[i].callback(&event, current[i].ctx);
+            if (current[i].queue && xQueueSend(current[i].queue, &event, 0) != pdTRUE) {
+                ESP_LOGW(TAG, "Subscriber queue full, dropped event %d", event.id);
+            }
+        }
+    }
+}
+
+// Adds a subscriber, starting the dispatcher task if needed.
+static esp_err_t wifi_add_subscriber(wifi_connection_event_cb_t callback, void* ctx, QueueHandle_t queue) {
+    esp_err_t res = ESP_ERR_NO_MEM;
+    xSemaphoreTake(subscribersMutex, portMAX_DELAY);
+    if (!eventQueue) {
+        eventQueue = xQueueCreate(WIFI_EVENT_QUEUE_LENGTH, sizeof(wifi_connection_event_t));
+        if (!eventQueue) goto error;
+        if (bsp_task_create(BSP_TASK_WIFI_EVENTS, wifi_dispatch_task, NULL) != pdPASS) {
+            vQueueDelete(eventQueue);
+            eventQueue = NULL;
+            goto error;
+        }
+    }
+    for (size_t i = 0; i < WIFI_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].callback || subscribers[i].queue) continue;
+        subscribers[i].callback = callback;
+        subscribers[i].ctx      = ctx;
+        subscribers[i].queue    = queue;
+        res = ESP_OK;
+        break;
+    }
+    error:
+    xSemaphoreGive(subscribersMutex);
+    return res;
+}
+
+// Removes a subscriber.
+static esp_err_t wifi_remove_subscriber(wifi_connection_event_cb_t callback, void* ctx, QueueHandle_t queue) {
+    esp_err_t res = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(subscribersMutex, portMAX_DELAY);
+    for (size_t i = 0; i < WIFI_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].callback != callback || subscribers[i].ctx != ctx || subscribers[i].queue != queue) continue;
+        memset(&subscribers[i], 0, sizeof(subscribers[i]));
+        res = ESP_OK;
+        break;
+    }
+    xSemaphoreGive(subscribersMutex);
+    return res;
+}
+
+// Makes the next connection attempt once the backoff delay has passed.
+static void wifi_reconnect(void* arg) {
+    esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_RECONNECT, NULL, 0, portMAX_DELAY);
+}
+
+// Changes the connection state, called from the event loop task only.
+static void wifi_set_state(wifi_connection_state_t state) {
+    portENTER_CRITICAL(&statusLock);
+    status.state = state;
+    portEXIT_CRITICAL(&statusLock);
+}
+
+// Has the driver associate, no disconnect event follows if it refuses so handle that here.
+// Called from the event loop task only.
+static void wifi_connect_start() {
+    esp_err_t res = esp_wifi_connect();
+    if (res == ESP_OK) return;
+    ESP_LOGE(TAG, "Failed to start connecting: %s", esp_err_to_name(res));
+    wifi_connect_failed(WIFI_REASON_UNSPECIFIED);
+}
+
+// Makes a connection attempt, or defers it until the running scan is done.
+// Called from the event loop task only.
+static void wifi_connect_now() {
+    portENTER_CRITICAL(&statusLock);
+    status.state   = WIFI_STATE_CONNECTING;
+    connectPending = status.scanning;
+    bool pending   = connectPending;
+    portEXIT_CRITICAL(&statusLock);
+    wifi_connection_event_t event = {
+        .id      = WIFI_CONNECTION_EVENT_CONNECTING,
+        .attempt = status.retries,
+    };
+    wifi_publish(&event);
+    if (pending) {
+        ESP_LOGI(TAG, "Connecting after the scan");
+        return;
+    }
+    wifi_connect_start();
+}
+
+// Retries after a failed connection attempt or a lost connection, or gives up when out of retries.
+// Called from the event loop task only.
+static void wifi_connect_failed(uint8_t reason) {
+    portENTER_CRITICAL(&timingLock);
+    if (timingActive) {
+        timing.retries++;
+        timing.last_reason = reason;
+    }
+    portEXIT_CRITICAL(&timingLock);
+    if (status.max_retries == WIFI_INFINITE_RETRIES || status.retries < status.max_retries) {
+        // Time reconnects after losing an established connection as well.
+        if (!timingActive) wifi_timing_begin(reason);
+        uint32_t delay = wifi_backoff_delay(reason, status.retries);
+        wifi_record_disconnect(reason, delay, true);
+        wifi_publish_disconnect(reason, true);
+        portENTER_CRITICAL(&statusLock);
+        if (status.retries < UINT8_MAX) status.retries++;
+        status.state = WIFI_STATE_BACKOFF;
+        portEXIT_CRITICAL(&statusLock);
+        if (delay) {
+            esp_timer_start_once(reconnectTimer, (uint64_t) delay * 1000);
+        } else {
+            wifi_connect_now();
+        }
+        ESP_LOGI(TAG, "Retrying connection in %u ms (reason %d)", delay, reason);
+    } else {
+        wifi_record_disconnect(reason, 0, false);
+        portENTER_CRITICAL(&timingLock);
+        if (timingActive) {
+            timingActive = false;
+            timingStats.failures++;
+        }
+        portEXIT_CRITICAL(&timingLock);
+        ESP_LOGI(TAG, "Connection failed (reason %d)", reason);
+        wifi_set_state(WIFI_STATE_FAILED);
+        xEventGroupSetBits(wifiEventGroup, WIFI_FAIL_BIT);
+        wifi_publish_disconnect(reason, false);
+    }
+}
+
+// Claims the radio for a scan, returns false if another scan is running.
+static bool wifi_scan_claim() {
+    portENTER_CRITICAL(&statusLock);
+    bool claimed = !status.scanning;
+    status.scanning = true;
+    portEXIT_CRITICAL(&statusLock);
+    return claimed;
+}
+
+// Releases the radio after a scan, returns whether a connection attempt was deferred.
+static bool wifi_scan_release() {
+    portENTER_CRITICAL(&statusLock);
+    status.scanning = false;
+    bool pending    = connectPending;
+    connectPending  = false;
+    portEXIT_CRITICAL(&statusLock);
+    return pending;
+}
+
+// Periodically triggers a roaming check.
+static void wifi_link_timer(void* arg) {
+    // Don't block the timer task, the next period will do.
+    esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_LINK_CHECK, NULL, 0, 0);
+}
+
+// Locks the station config to the roaming target, or unlocks it so the driver picks the AP again.
+static void wifi_roam_pin(bool pin) {
+    wifi_config_t wifi_config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK) return;
+    wifi_config.sta.bssid_set = pin;
+    wifi_config.sta.channel   = pin ? roamChannel : 0;
+    if (pin) memcpy(wifi_config.sta.bssid, roamBssid, sizeof(roamBssid));
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    roamPinned = pin;
+}
+
+// Picks the strongest AP of the current network found by the roaming scan and moves to it.
+// Called from the event loop task when the roaming scan is done.
+static void wifi_roam_scan_done(const wifi_scan_progress_t* progress, void* ctx) {
+    if (!progress->done) return;
+    roamState = WIFI_ROAM_IDLE;
+    wifi_ap_record_t ap_info;
+    if (status.state != WIFI_STATE_CONNECTED || esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+    
+    int8_t min_rssi = ap_info.rssi + roamConfig.hysteresis;
+    bool   found    = false;
+    xSemaphoreTake(scanCacheMutex, portMAX_DELAY);
+    // The cache is sorted strongest first.
+    for (size_t i = 0; i < scanCacheCount && !found; i++) {
+        const wifi_ap_record_t* ap = &scanCache[i];
+        if (scanCacheSeen[i] < roamScanTime || ap->rssi < min_rssi) continue;
+        if (strcmp((const char*) ap->ssid, (const char*) ap_info.ssid)) continue;
+        if (!memcmp(ap->bssid, ap_info.bssid, sizeof(ap->bssid))) continue;
+        memcpy(roamBssid, ap->bssid, sizeof(roamBssid));
+        roamChannel = ap->primary;
+        found       = true;
+        ESP_LOGI(TAG, "Roaming from " MACSTR " (rssi=%hhd) to " MACSTR " (rssi=%hhd)",
+            MAC2STR(ap_info.bssid), ap_info.rssi, MAC2STR(ap->bssid), ap->rssi);
+    }
+    xSemaphoreGive(scanCacheMutex);
+    if (!found) return;
+    
+    // Reassociation continues in the disconnect handler.
+    roamState = WIFI_ROAM_LEAVING;
+    esp_wifi_disconnect();
+}
+
+#ifdef CONFIG_WPA_11KV_SUPPORT
+// Learns the channels of the neighbor APs an 802.11k capable AP reported.
+static void wifi_roam_neighbor_report(void* ctx, const uint8_t* report, size_t report_len) {
+    // Neighbor report elements: id, length, BSSID (6), BSSID info (4), operating class, channel, PHY type.
+    const uint8_t* pos = report;
+    const uint8_t* end = report + report_len;
+    while (report && end - pos >= 2 && end - pos >= 2 + pos[1]) {
+        if (pos[0] == 52 && pos[1] >= 13) wifi_scan_add_known_channel(pos[2 + 11]);
+        pos += 2 + pos[1];
+    }
+}
+#endif
+
+// Looks for a better AP if the signal of the current one is weak.
+// Called from the event loop task only.
+static void wifi_roam_check(const wifi_ap_record_t* ap_info) {
+    portENTER_CRITICAL(&statusLock);
+    wifi_roam_config_t config = roamConfig;
+    portEXIT_CRITICAL(&statusLock);
+    if (!config.enabled || roamState != WIFI_ROAM_IDLE || ap_info->rssi >= config.rssi_threshold) return;
+    
+    int64_t now = esp_timer_get_time();
+    if (roamScanTime && now - roamScanTime < (int64_t) config.scan_interval_ms * 1000) return;
+    roamScanTime = now;
+    ESP_LOGI(TAG, "Weak signal (rssi=%hhd), looking for a better AP", ap_info->rssi);
+
+#ifdef CONFIG_WPA_11KV_SUPPORT
+    // A BSS transition query lets the AP steer us itself, the neighbor report improves the next scans.
+    if (esp_wnm_is_btm_supported_connection()) esp_wnm_send_bss_transition_mgmt_query(REASON_RSSI, NULL, 0);
+    if (esp_rrm_is_rrm_supported_connection()) esp_rrm_send_neighbor_rep_request(wifi_roam_neighbor_report, NULL);
+#endif
+
+    // Only scan the channels our networks were seen on, to keep the time off-channel short.
+    if (wifi_scan_async_with_profile(WIFI_SCAN_PROFILE_FAST, wifi_roam_scan_done, NULL) == ESP_OK) {
+        roamState = WIFI_ROAM_SCANNING;
+    }
+}
+
+// Checks the signal of the current AP, reports changes and roams if needed.
+// Called from the event loop task only.
+static void wifi_link_check() {
+    wifi_ap_record_t ap_info;
+    if (status.state != WIFI_STATE_CONNECTED || esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+    if (abs(ap_info.rssi - linkRssi) >= WIFI_RSSI_CHANGE_THRESHOLD) {
+        wifi_connection_event_t event = {
+            .id   = WIFI_CONNECTION_EVENT_RSSI_CHANGED,
+            .rssi = ap_info.rssi,
+        };
+        memcpy(event.bssid, ap_info.bssid, sizeof(event.bssid));
+        wifi_publish(&event);
+        linkRssi = ap_info.rssi;
+    }
+    wifi_roam_check(&ap_info);
+}
+
+// Handles commands posted to the event loop by the API functions.
+static void command_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    switch (event_id) {
+        case WIFI_CMD_CONNECT: {
+            wifi_connect_cmd_t*     cmd      = (wifi_connect_cmd_t*) event_data;
+            wifi_connection_state_t previous = status.state;
+            bool                    busy     = previous == WIFI_STATE_CONNECTED || previous == WIFI_STATE_CONNECTING;
+            esp_timer_stop(reconnectTimer);
+            if (cmd->restart || !busy) wifi_timing_begin(0);
+            portENTER_CRITICAL(&statusLock);
+            status.state       = cmd->restart || !busy ? WIFI_STATE_CONNECTING : previous;
+            status.retries     = 0;
+            status.max_retries = cmd->max_retries;
+            reconnectRetries   = cmd->reconnect_retries;
+            connectPending     = false;
+            portEXIT_CRITICAL(&statusLock);
+            // The new config replaced any roaming target, the connect hint is undone on the first disconnect.
+            roamPinned = cmd->pinned;
+            if (cmd->restart) {
+                roamState = WIFI_ROAM_IDLE;
+                // The connection attempt itself starts on WIFI_EVENT_STA_START.
+            } else if (!busy) {
+                wifi_connect_now();
+            }
+            break;
+        }
+        case WIFI_CMD_DISCONNECT:
+            esp_timer_stop(reconnectTimer);
+            esp_timer_stop(linkTimer);
+            roamState = WIFI_ROAM_IDLE;
+            portENTER_CRITICAL(&timingLock);
+            timingActive = false;
+            portEXIT_CRITICAL(&timingLock);
+            portENTER_CRITICAL(&statusLock);
+            status.state       = WIFI_STATE_IDLE;
+            status.max_retries = 0;
+            connectPending     = false;
+            portEXIT_CRITICAL(&statusLock);
+            break;
+        case WIFI_CMD_RECONNECT:
+            // Ignore timers that fired just before a new connection or disconnect.
+            if (status.state == WIFI_STATE_BACKOFF) wifi_connect_now();
+            break;
+        case WIFI_CMD_SCAN_END:
+            // A connection attempt waited for the scan.
+            if (status.state == WIFI_STATE_CONNECTING) wifi_connect_start();
+            break;
+        case WIFI_CMD_LINK_CHECK:
+            wifi_link_check();
+            break;
+    }
+}
+
+// Adds the time spent in the current modem sleep mode since the last call.
+// Must be called with the power mutex held.
+static void wifi_power_account(bool started) {
+    int64_t now = esp_timer_get_time();
+    if (powerSince) powerTime[powerMode] += now - powerSince;
+    powerSince = started ? now : 0;
+}
+
+// Applies the modem sleep mode for the most demanding latency requested.
+// Must be called with the power mutex held.
+static void wifi_power_apply() {
+    wifi_latency_t latency = powerDefault;
+    for (int i = WIFI_LATENCY_COUNT - 1; i > (int) latency; i--) {
+        if (powerRequests[i]) {
+            latency = i;
+            break;
+        }
+    }
+    wifi_ps_type_t mode = latency == WIFI_LATENCY_INTERACTIVE ? WIFI_PS_NONE :
+                          latency == WIFI_LATENCY_BACKGROUND  ? WIFI_PS_MIN_MODEM : WIFI_PS_MAX_MODEM;
+    powerLatency = latency;
+    if (mode == powerMode) return;
+    
+    esp_err_t res = esp_wifi_set_ps(mode);
+    if (res) {
+        // WIFI_PS_NONE is not allowed while Bluetooth is active.
+        ESP_LOGW(TAG, "Failed to set power save mode %d: %s", mode, esp_err_to_name(res));
+        return;
+    }
+    wifi_power_account(powerSince != 0);
+    powerMode = mode;
+    ESP_LOGI(TAG, "Power save mode %d for latency level %d", mode, latency);
+}
+
+// Listen interval to associate with.
+static uint16_t wifi_power_listen_interval() {
+    return powerLatency == WIFI_LATENCY_IDLE ? WIFI_LISTEN_INTERVAL_IDLE : WIFI_LISTEN_INTERVAL_DEFAULT;
+}
+
 // Handles WiFi events required to stay connected.
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         xEventGroupSetBits(wifiEventGroup, WIFI_STARTED_BIT);
-        if (!isScanning) {
-            // Connect only if we're not scanning the WiFi.
-            esp_wifi_connect();
-        }
+        xSemaphoreTake(powerMutex, portMAX_DELAY);
+        wifi_power_account(true);
+        xSemaphoreGive(powerMutex);
+        portENTER_CRITICAL(&timingLock);
+        if (timingActive && !timing.started_us) timing.started_us = wifi_timing_elapsed();
+        portEXIT_CRITICAL(&timingLock);
+        // WiFi may have been started for an asynchronous scan, a connection then waits for it.
+        if (scanAsyncActive) wifi_scan_async_next();
+        // Connect only if WiFi was started to connect, not just to scan.
+        if (status.state == WIFI_STATE_CONNECTING) wifi_connect_now();
         ESP_LOGI(TAG, "WiFi station start.");
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_STOP) {
         xEventGroupClearBits(wifiEventGroup, WIFI_STARTED_BIT);
+        xSemaphoreTake(powerMutex, portMAX_DELAY);
+        wifi_power_account(false);
+        xSemaphoreGive(powerMutex);
+        if (scanAsyncActive) {
+            // Stopped mid-scan, so the channel being scanned never reports done.
+            scanAsyncStopWhenDone = false;
+            wifi_scan_async_cut_short();
+        }
         ESP_LOGI(TAG, "WiFi station stop.");
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        if (scanAsyncActive) wifi_scan_async_channel_done();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+        memcpy(connectedBssid, event->bssid, sizeof(connectedBssid));
+        wifi_scan_add_known_channel(event->channel);
+        portENTER_CRITICAL(&timingLock);
+        if (timingActive) timing.associated_us = wifi_timing_elapsed();
+        portEXIT_CRITICAL(&timingLock);
+        wifi_connection_event_t associated = {
+            .id = WIFI_CONNECTION_EVENT_ASSOCIATED,
+        };
+        memcpy(associated.bssid, event->bssid, sizeof(associated.bssid));
+        wifi_publish(&associated);
+        wifi_lease_expect(event->bssid);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (maxRetries == WIFI_INFINITE_RETRIES || retryCount < maxRetries) {
-            esp_wifi_connect();
-            retryCount++;
-            ESP_LOGI(TAG, "Retrying connection");
-        } else {
-            ESP_LOGI(TAG, "Connection failed");
-            xEventGroupSetBits(wifiEventGroup, WIFI_FAIL_BIT);
+        // The DHCP client starts over on the next association.
+        leaseExpected = false;
+        leaseReused   = false;
+        wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+        xEventGroupClearBits(wifiEventGroup, WIFI_CONNECTED_BIT);
+        esp_timer_stop(linkTimer);
+        if (status.state == WIFI_STATE_IDLE || status.state == WIFI_STATE_FAILED) {
+            // Disconnected on purpose, or the last attempt of a connection that failed.
+            ESP_LOGI(TAG, "Disconnected (reason %d)", event->reason);
+            wifi_publish_disconnect(event->reason, false);
+            return;
+        }
+        if (roamState == WIFI_ROAM_LEAVING) {
+            // Left the old AP on purpose, associate with the better one right away.
+            roamState = WIFI_ROAM_JOINING;
+            wifi_publish_disconnect(event->reason, true);
+            wifi_roam_pin(true);
+            wifi_connect_now();
+            return;
+        }
+        if (roamState == WIFI_ROAM_JOINING) {
+            ESP_LOGW(TAG, "Roaming failed (reason %d)", event->reason);
+            roamState = WIFI_ROAM_IDLE;
         }
+        // Let the driver pick any AP of the network again, after roaming or a directed connect.
+        if (roamPinned) wifi_roam_pin(false);
+        wifi_connect_failed(event->reason);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        memcpy(&ip_info, &event->ip_info, sizeof(ip_info));
+        portENTER_CRITICAL(&statusLock);
+        memcpy(&status.ip_info, &event->ip_info, sizeof(status.ip_info));
+        status.state       = WIFI_STATE_CONNECTED;
+        status.retries     = 0;
+        status.max_retries = reconnectRetries;
+        portEXIT_CRITICAL(&statusLock);
         ESP_LOGI(TAG, "IP          : " IPSTR, IP2STR(&event->ip_info.ip));
         ESP_LOGI(TAG, "Netmask     : " IPSTR, IP2STR(&event->ip_info.netmask));
         ESP_LOGI(TAG, "Gateway     : " IPSTR, IP2STR(&event->ip_info.gw));
-        retryCount = 0;
+        wifi_lease_got_ip(&event->ip_info.ip);
+        if (timingActive) wifi_timing_finish();
+        roamState = WIFI_ROAM_IDLE;
+        esp_timer_stop(linkTimer);
+        esp_timer_start_periodic(linkTimer, (uint64_t) WIFI_LINK_CHECK_INTERVAL_MS * 1000);
         xEventGroupSetBits(wifiEventGroup, WIFI_CONNECTED_BIT);
+        
+        wifi_connection_event_t connected = {
+            .id      = WIFI_CONNECTION_EVENT_CONNECTED,
+            .ip_info = event->ip_info,
+        };
+        wifi_ap_record_t ap_info;
+        if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+            memcpy(connected.bssid, ap_info.bssid, sizeof(connected.bssid));
+            connected.rssi = ap_info.rssi;
+            linkRssi       = ap_info.rssi;
+        }
+        wifi_publish(&connected);
     }
 }
 
 esp_netif_ip_info_t* wifi_get_ip_info() {
-    return &ip_info;
+    return &status.ip_info;
+}
+
+// Call `callback` from the dispatcher task for every connection event.
+esp_err_t wifi_subscribe(wifi_connection_event_cb_t callback, void* ctx) {
+    if (!callback) return ESP_ERR_INVALID_ARG;
+    return wifi_add_subscriber(callback, ctx, NULL);
+}
+
+// Stop calling a callback added with `wifi_subscribe`.
+esp_err_t wifi_unsubscribe(wifi_connection_event_cb_t callback, void* ctx) {
+    if (!callback) return ESP_ERR_INVALID_ARG;
+    return wifi_remove_subscriber(callback, ctx, NULL);
+}
+
+// Send a copy of every connection event to `queue`.
+esp_err_t wifi_subscribe_queue(QueueHandle_t queue) {
+    if (!queue) return ESP_ERR_INVALID_ARG;
+    return wifi_add_subscriber(NULL, NULL, queue);
+}
+
+// Stop sending events to a queue added with `wifi_subscribe_queue`.
+esp_err_t wifi_unsubscribe_queue(QueueHandle_t queue) {
+    if (!queue) return ESP_ERR_INVALID_ARG;
+    return wifi_remove_subscriber(NULL, NULL, queue);
+}
+
+// Set the roaming policy.
+void wifi_set_roaming(const wifi_roam_config_t* config) {
+    portENTER_CRITICAL(&statusLock);
+    roamConfig = *config;
+    portEXIT_CRITICAL(&statusLock);
+}
+
+// Get the roaming policy.
+void wifi_get_roaming(wifi_roam_config_t* config) {
+    portENTER_CRITICAL(&statusLock);
+    *config = roamConfig;
+    portEXIT_CRITICAL(&statusLock);
+}
+
+// Get a consistent snapshot of the connection state.
+void wifi_get_status(wifi_connection_status_t* aStatus) {
+    portENTER_CRITICAL(&statusLock);
+    *aStatus = status;
+    portEXIT_CRITICAL(&statusLock);
 }
 
 // Firt time initialisation of the WiFi stack.
 void wifi_init() {
+    // Background connects initialise early, apps may still call this themselves.
+    if (wifiInitialised) return;
+    
     // Initialise WiFi stack.
     ESP_ERROR_CHECK(esp_netif_init());
     
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    // The app may have created the default event loop already.
+    esp_err_t res = esp_event_loop_create_default();
+    if (res != ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(res);
     esp_netif_create_default_wifi_sta();
     
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    // Keep the driver task on the radio core.
+    BaseType_t wifi_core = bsp_task_get_config(BSP_TASK_WIFI)->core;
+    if (wifi_core != tskNO_AFFINITY) cfg.wifi_task_core_id = wifi_core;
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
     
     // Initialise internal resources.
@@ -84,14 +876,118 @@ void wifi_init() {
 // Initialises internal resources only.
 // Use this if ESP32 WiFi is already initialised.
 void wifi_init_no_hardware() {
+    if (wifiInitialised) return;
+    wifiInitialised = true;
+    
     // Create an event group for WiFi things.
     wifiEventGroup = xEventGroupCreate();
     
+    // Timer for delayed reconnects.
+    esp_timer_create_args_t reconnect_timer_args = {
+        .callback = wifi_reconnect,
+        .name     = "wifi_reconnect",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &reconnectTimer));
+    
+    // Timer for roaming checks while connected.
+    esp_timer_create_args_t roam_timer_args = {
+        .callback = wifi_link_timer,
+        .name     = "wifi_roam",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&roam_timer_args, &linkTimer));
+    wifi_lease_load();
+    
+    // Create the scan cache lock.
+    scanCacheMutex = xSemaphoreCreateMutex();
+    apiMutex       = xSemaphoreCreateMutex();
+    
+    // The dispatcher task is started by the first subscription.
+    subscribersMutex = xSemaphoreCreateMutex();
+    
+    // Apply the default power save policy.
+    powerMutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    esp_wifi_get_ps(&powerMode);
+    wifi_power_apply();
+    xSemaphoreGive(powerMutex);
+    
     // Register event handlers for WiFi.
     esp_event_handler_instance_t instance_any_id;
     esp_event_handler_instance_t instance_got_ip;
+    esp_event_handler_instance_t instance_cmd;
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, &instance_any_id));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, &instance_got_ip));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_CONNECTION_CMD, ESP_EVENT_ANY_ID, &command_handler, NULL, &instance_cmd));
+}
+
+// Start the WiFi driver in station mode without connecting.
+esp_err_t wifi_start() {
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
+    keepStarted++;
+    esp_err_t res = ESP_OK;
+    if (!(xEventGroupGetBits(wifiEventGroup) & WIFI_STARTED_BIT)) {
+        // Configure what can only be configured while stopped, the connect calls then only set the network.
+        WIFI_SORT_ERRCHECK(res = esp_wifi_set_mode(WIFI_MODE_STA));
+        // Disable 11b as NOC asked.
+        WIFI_SORT_ERRCHECK(res = esp_wifi_config_11b_rate(WIFI_IF_STA, true));
+        // Nothing is connecting, so WIFI_EVENT_STA_START only marks the driver as started.
+        WIFI_SORT_ERRCHECK(res = esp_wifi_start());
+        ESP_LOGI(TAG, "WiFi started ahead of connecting");
+    }
+    
+    error:
+    if (res) keepStarted--;
+    xSemaphoreGive(apiMutex);
+    return res;
+}
+
+// Undo one `wifi_start`, stopping the driver once none are left unless it's connecting, connected or scanning.
+void wifi_stop() {
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
+    if (keepStarted) keepStarted--;
+    portENTER_CRITICAL(&statusLock);
+    bool idle = !status.scanning && (status.state == WIFI_STATE_IDLE || status.state == WIFI_STATE_FAILED);
+    portEXIT_CRITICAL(&statusLock);
+    if (!keepStarted && idle) esp_wifi_stop();
+    xSemaphoreGive(apiMutex);
+}
+
+// Set the BSSID and channel to use for the next connection attempt.
+void wifi_set_connect_hint(const uint8_t* aBssid, uint8_t aChannel) {
+    if (!aBssid) {
+        connectHintSet = false;
+        return;
+    }
+    memcpy(connectHintBssid, aBssid, sizeof(connectHintBssid));
+    connectHintChannel = aChannel;
+    connectHintSet     = true;
+}
+
+// Set the retry limit for after the next connection is established.
+void wifi_set_reconnect_retries(uint8_t aRetryMax) {
+    connectReconnectRetries = aRetryMax;
+    connectReconnectSet     = true;
+}
+
+// Fills in the retry limits of a connect command and consumes the reconnect limit.
+static void wifi_apply_retries(wifi_connect_cmd_t* cmd, uint8_t aRetryMax) {
+    cmd->max_retries       = aRetryMax;
+    cmd->reconnect_retries = connectReconnectSet ? connectReconnectRetries : aRetryMax;
+    connectReconnectSet    = false;
+}
+
+// Applies the connection hint to a config, if any, and consumes it.
+// Returns whether the config is now locked to the hinted AP.
+static bool wifi_apply_connect_hint(wifi_config_t* wifi_config) {
+    if (!connectHintSet) return false;
+    // With a channel set, the driver only scans that channel before associating.
+    wifi_config->sta.bssid_set   = true;
+    memcpy(wifi_config->sta.bssid, connectHintBssid, sizeof(connectHintBssid));
+    wifi_config->sta.channel     = connectHintChannel;
+    wifi_config->sta.scan_method = WIFI_FAST_SCAN;
+    connectHintSet = false;
+    ESP_LOGI(TAG, "Directed connect on channel %d", connectHintChannel);
+    return true;
 }
 
 // Connect to a traditional username/password WiFi network.
@@ -116,48 +1012,125 @@ bool wifi_connect_ent(const char* aSsid, const char *aIdent, const char *aAnonId
 // Will return right away.
 // Will try at most `aRetryMax` times, or forever if it's WIFI_INFINITE_RETRIES.
 void wifi_connect_async(const char* aSsid, const char* aPassword, wifi_auth_mode_t aAuthmode, uint8_t aRetryMax) {
-    // Set the retry counts.
-    retryCount = 0;
-    maxRetries = aRetryMax;
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
     
-    // Disable WiFi if it was active, reset event bits
-    esp_wifi_disconnect();
-    esp_wifi_stop();
-    xEventGroupClearBits(wifiEventGroup, 0xFF);
+    // A driver started by `wifi_start` that isn't connected can take the new config as is.
+    // Scans start the driver as well but without the 11b rates disabled, and may be stopping it.
+    wifi_connection_state_t state = status.state;
+    bool warm = !entEnabled && keepStarted && (state == WIFI_STATE_IDLE || state == WIFI_STATE_FAILED);
+    if (warm) {
+        xEventGroupClearBits(wifiEventGroup, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+    } else {
+        // Disable WiFi if it was active, reset event bits
+        esp_wifi_disconnect();
+        esp_wifi_stop();
+        xEventGroupClearBits(wifiEventGroup, 0xFF);
+        if (entEnabled) {
+            esp_wifi_sta_wpa2_ent_disable();
+            entEnabled = false;
+        }
+    }
     
     // Create a config.
     wifi_config_t wifi_config = {0};
     memcpy((char*) wifi_config.sta.ssid, aSsid, strnlen(aSsid, 32)); // Target does NOT have to be NULL terminated
     memcpy((char*) wifi_config.sta.password, aPassword, strnlen(aPassword, 64)); // Target does NOT have to be NULL terminated
     wifi_config.sta.threshold.authmode = aAuthmode;
+    wifi_config.sta.listen_interval    = wifi_power_listen_interval();
+#ifdef CONFIG_WPA_11KV_SUPPORT
+    // Allow APs to send neighbor reports and steer us to other APs.
+    wifi_config.sta.rm_enabled  = true;
+    wifi_config.sta.btm_enabled = true;
+#endif
+    wifi_connect_cmd_t cmd = {
+        .restart = !warm,
+        .pinned  = wifi_apply_connect_hint(&wifi_config),
+    };
+    wifi_apply_retries(&cmd, aRetryMax);
+    
+    if (warm) {
+        // The mode and 11b rates were set by `wifi_start`, connect right away.
+        WIFI_SORT_ERRCHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+        WIFI_SORT_ERRCHECK(esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_CONNECT, &cmd, sizeof(cmd), portMAX_DELAY));
+        ESP_LOGI(TAG, "Connecting to WiFi without restarting...");
+        goto error;
+    }
     
     // Set WiFi config.
     WIFI_SORT_ERRCHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     WIFI_SORT_ERRCHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     // Disable 11b as NOC asked.
     esp_wifi_config_11b_rate(WIFI_IF_STA, true);
+    // Set the retry counts, this is handled before WIFI_EVENT_STA_START.
+    WIFI_SORT_ERRCHECK(esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_CONNECT, &cmd, sizeof(cmd), portMAX_DELAY));
     // Start WiFi.
     WIFI_SORT_ERRCHECK(esp_wifi_start());
     
     ESP_LOGI(TAG, "Connecting to WiFi...");
     
     error:
-    return;
+    xSemaphoreGive(apiMutex);
+}
+
+// Hashes an enterprise network config (FNV-1a), so it can be recognised without keeping the password.
+static uint32_t wifi_ent_config_id(const char* aSsid, const char *aIdent, const char *aAnonIdent, const char* aPassword, esp_eap_ttls_phase2_types phase2) {
+    const char* fields[] = {aSsid, aIdent, aAnonIdent, aPassword};
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        // Include the terminators so field boundaries count.
+        const char* c = fields[i];
+        do {
+            hash = (hash ^ (uint8_t) *c) * 16777619u;
+        } while (*c++);
+    }
+    return (hash ^ (uint8_t) phase2) * 16777619u;
 }
 
 // Connect to a WPA2 enterprise WiFi network.
 // Will return right away.
 // Will try at most `aRetryMax` times, or forever if it's WIFI_INFINITE_RETRIES.
 void wifi_connect_ent_async(const char* aSsid, const char *aIdent, const char *aAnonIdent, const char* aPassword, esp_eap_ttls_phase2_types phase2, uint8_t aRetryMax) {
-    retryCount = 0;
-    maxRetries = aRetryMax;
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
+    wifi_connect_cmd_t cmd = {
+        .restart = true,
+    };
+    wifi_apply_retries(&cmd, aRetryMax);
+    
+    // Keep the driver running with the same EAP config if possible: stopping it or
+    // enabling enterprise auth again throws away the PMK cache.
+    uint32_t config_id = wifi_ent_config_id(aSsid, aIdent, aAnonIdent, aPassword, phase2);
+    if (entEnabled && entConfigId == config_id && (xEventGroupGetBits(wifiEventGroup) & WIFI_STARTED_BIT)) {
+        ESP_LOGI(TAG, "Reconnecting to '%s' as '%s'/'%s' with PMK caching", aSsid, aIdent, aAnonIdent);
+        cmd.restart = false;
+        // Use the new hint, or let the driver pick any AP again if an earlier one is still pinned.
+        // Setting the config while started keeps the PMK cache.
+        wifi_config_t wifi_config;
+        WIFI_SORT_ERRCHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+        wifi_config.sta.bssid_set = false;
+        wifi_config.sta.channel   = 0;
+        cmd.pinned = wifi_apply_connect_hint(&wifi_config);
+        WIFI_SORT_ERRCHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+        xEventGroupClearBits(wifiEventGroup, WIFI_FAIL_BIT);
+        WIFI_SORT_ERRCHECK(esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_CONNECT, &cmd, sizeof(cmd), portMAX_DELAY));
+        xSemaphoreGive(apiMutex);
+        return;
+    }
+    
     wifi_config_t wifi_config = {0};
     memcpy((char*) wifi_config.sta.ssid, aSsid, strnlen(aSsid, 32)); // Target does NOT have to be NULL terminated
+    wifi_config.sta.listen_interval = wifi_power_listen_interval();
+#ifdef CONFIG_WPA_11KV_SUPPORT
+    // Allow APs to send neighbor reports and steer us to other APs.
+    wifi_config.sta.rm_enabled  = true;
+    wifi_config.sta.btm_enabled = true;
+#endif
+    cmd.pinned = wifi_apply_connect_hint(&wifi_config);
     
     // Disable WiFi if it was active, reset event bits
     esp_wifi_disconnect();
     esp_wifi_stop();
     xEventGroupClearBits(wifiEventGroup, 0xFF);
+    entEnabled = false;
     
     // Set WiFi config.
     WIFI_SORT_ERRCHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
@@ -170,22 +1143,43 @@ void wifi_connect_ent_async(const char* aSsid, const char *aIdent, const char *a
     WIFI_SORT_ERRCHECK(esp_wifi_sta_wpa2_ent_set_ttls_phase2_method(phase2));
     // Enable enterprise auth.
     WIFI_SORT_ERRCHECK(esp_wifi_sta_wpa2_ent_enable());
+    entEnabled  = true;
+    entConfigId = config_id;
     // Disable 11b as NOC asked.
     WIFI_SORT_ERRCHECK(esp_wifi_config_11b_rate(WIFI_IF_STA, true));
+    // Set the retry counts, this is handled before WIFI_EVENT_STA_START.
+    WIFI_SORT_ERRCHECK(esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_CONNECT, &cmd, sizeof(cmd), portMAX_DELAY));
     // Start the connection.
     WIFI_SORT_ERRCHECK(esp_wifi_start());
     
-    ESP_LOGI(TAG, "Connecting to '%s' as '%s'/'%s': %s", aSsid, aIdent, aAnonIdent, aPassword);
+    ESP_LOGI(TAG, "Connecting to '%s' as '%s'/'%s'", aSsid, aIdent, aAnonIdent);
     ESP_LOGI(TAG, "Phase2 mode: %d", phase2);
     
     error:
-    return;
+    xSemaphoreGive(apiMutex);
 }
 
 // Disconnect from WiFi and do not attempt to reconnect.
 void wifi_disconnect() {
-    maxRetries = 0;
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
+    // Handled before the disconnect event, so there's no reconnect.
+    esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_DISCONNECT, NULL, 0, portMAX_DELAY);
+    keepStarted = 0;
     esp_wifi_stop();
+    xSemaphoreGive(apiMutex);
+}
+
+// Stop connecting or disconnect like `wifi_disconnect`, but leave a driver kept running by `wifi_start` running.
+void wifi_abort_connect() {
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
+    // Handled before the disconnect event, so there's no reconnect.
+    esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_DISCONNECT, NULL, 0, portMAX_DELAY);
+    if (keepStarted) {
+        esp_wifi_disconnect();
+    } else {
+        esp_wifi_stop();
+    }
+    xSemaphoreGive(apiMutex);
 }
 
 // Awaits WiFi to be connected for at most `max_delay_millis` milliseconds.
@@ -202,16 +1196,89 @@ bool wifi_await(uint64_t max_delay_millis) {
     } else if (bits & WIFI_FAIL_BIT) {
         // WiFi failed to connect (out of retries).
         ESP_LOGE(TAG, "Failed to connect");
-        WIFI_SORT_ERRCHECK(esp_wifi_stop());
+        // Stay started if another attempt is likely to follow.
+        if (!keepStarted) WIFI_SORT_ERRCHECK(esp_wifi_stop());
     } else {
         // Other error.
         ESP_LOGE(TAG, "Unknown event received while waiting on connection");
-        WIFI_SORT_ERRCHECK(esp_wifi_stop());
+        if (keepStarted) {
+            // Give up on this attempt but leave the driver running.
+            esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_DISCONNECT, NULL, 0, portMAX_DELAY);
+            esp_wifi_disconnect();
+        } else {
+            WIFI_SORT_ERRCHECK(esp_wifi_stop());
+        }
     }
     error:
     return false;
 }
 
+// Get the timing of the current or last connection and aggregates over past connections.
+void wifi_get_connect_timing(wifi_connect_timing_t* last, wifi_connect_stats_t* stats) {
+    portENTER_CRITICAL(&timingLock);
+    if (last) *last = timing;
+    if (stats) *stats = timingStats;
+    portEXIT_CRITICAL(&timingLock);
+}
+
+// Reset the connection timing aggregates.
+void wifi_reset_connect_stats() {
+    portENTER_CRITICAL(&timingLock);
+    memset(&timingStats, 0, sizeof(timingStats));
+    portEXIT_CRITICAL(&timingLock);
+}
+
+// Get the most recent disconnects, newest first.
+size_t wifi_get_reconnect_history(wifi_reconnect_attempt_t* attempts, size_t max_attempts) {
+    // At most WIFI_RECONNECT_HISTORY small records, short enough to copy in a critical section.
+    portENTER_CRITICAL(&statusLock);
+    size_t count = reconnectHistoryCount < max_attempts ? reconnectHistoryCount : max_attempts;
+    for (size_t i = 0; i < count; i++) {
+        attempts[i] = reconnectHistory[(reconnectHistoryNext + WIFI_RECONNECT_HISTORY - 1 - i) % WIFI_RECONNECT_HISTORY];
+    }
+    portEXIT_CRITICAL(&statusLock);
+    return count;
+}
+
+// Declare latency needs until the matching `wifi_power_release`.
+void wifi_power_request(wifi_latency_t latency) {
+    if (latency >= WIFI_LATENCY_COUNT) return;
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    powerRequests[latency]++;
+    wifi_power_apply();
+    xSemaphoreGive(powerMutex);
+}
+
+// Withdraw a request made with `wifi_power_request`.
+void wifi_power_release(wifi_latency_t latency) {
+    if (latency >= WIFI_LATENCY_COUNT) return;
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    if (powerRequests[latency]) powerRequests[latency]--;
+    wifi_power_apply();
+    xSemaphoreGive(powerMutex);
+}
+
+// Set the latency level used when there are no requests.
+void wifi_power_set_default(wifi_latency_t latency) {
+    if (latency >= WIFI_LATENCY_COUNT) return;
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    powerDefault = latency;
+    wifi_power_apply();
+    xSemaphoreGive(powerMutex);
+}
+
+// Get the current power save state and the time spent in each modem sleep mode.
+void wifi_power_get_stats(wifi_power_stats_t* stats) {
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    wifi_power_account(powerSince != 0);
+    stats->latency      = powerLatency;
+    stats->mode         = powerMode;
+    stats->none_us      = powerTime[WIFI_PS_NONE];
+    stats->min_modem_us = powerTime[WIFI_PS_MIN_MODEM];
+    stats->max_modem_us = powerTime[WIFI_PS_MAX_MODEM];
+    xSemaphoreGive(powerMutex);
+}
+
 // Test whether WiFi is currently connected.
 bool wifi_is_connected() {
     // This information is stored in the event group bits.
@@ -221,120 +1288,363 @@ bool wifi_is_connected() {
 }
 
 // Shows a nice info message describing an AP record.
-static inline void wifi_desc_record(wifi_ap_record_t *record) {
-    // Make a string representation of BSSID.
-    char *bssid_str = malloc(3*6);
-    if (!bssid_str) return;
-    snprintf(bssid_str, 3*6, "%02X:%02X:%02X:%02X:%02X:%02X",
-        record->bssid[0], record->bssid[1], record->bssid[2],
-        record->bssid[3], record->bssid[4], record->bssid[5]
-    );
-    
+static inline void wifi_desc_record(const wifi_ap_record_t *record) {
     // Make a string representation of 11b/g/n modes.
-    char *phy_str = malloc(9);
-    if (!phy_str) {
-        free(bssid_str);
-        return;
-    }
-    *phy_str = 0;
+    char phy_str[12] = "";
     if (record->phy_11b | record->phy_11g | record->phy_11n) {
-        strcpy(phy_str, " 1");
+        snprintf(phy_str, sizeof(phy_str), " 11%s%s%s",
+            record->phy_11b ? "/b" : "", record->phy_11g ? "/g" : "", record->phy_11n ? "/n" : "");
+        // Drop the slash after "11".
+        memmove(phy_str + 3, phy_str + 4, strlen(phy_str + 4) + 1);
     }
-    if (record->phy_11b) {
-        strcat(phy_str, "/b");
-    }
-    if (record->phy_11g) {
-        strcat(phy_str, "/g");
+    
+    ESP_LOGI(TAG, "AP " MACSTR " %s rssi=%hhd%s", MAC2STR(record->bssid), record->ssid, record->rssi, phy_str);
+}
+
+// Merges fresh scan results into the scan cache.
+// Must be called with the scan cache lock held.
+static void wifi_scan_cache_merge(const wifi_ap_record_t* aps, size_t num_ap) {
+    int64_t now = esp_timer_get_time();
+    
+    for (size_t i = 0; i < num_ap; i++) {
+        // Find the AP by BSSID.
+        size_t index = scanCacheCount;
+        for (size_t j = 0; j < scanCacheCount; j++) {
+            if (!memcmp(scanCache[j].bssid, aps[i].bssid, sizeof(aps[i].bssid))) {
+                index = j;
+                break;
+            }
+        }
+        if (index == scanCacheCount && scanCacheCount < WIFI_SCAN_CACHE_SIZE) {
+            // New AP.
+            scanCacheCount++;
+        } else if (index == scanCacheCount) {
+            // Cache is full, evict the least recently seen or weakest AP if this one is stronger.
+            index = 0;
+            for (size_t j = 1; j < scanCacheCount; j++) {
+                if (scanCacheSeen[j] < scanCacheSeen[index] ||
+                    (scanCacheSeen[j] == scanCacheSeen[index] && scanCache[j].rssi < scanCache[index].rssi)) {
+                    index = j;
+                }
+            }
+            if (scanCacheSeen[index] == now && scanCache[index].rssi >= aps[i].rssi) continue;
+        }
+        scanCache[index]     = aps[i];
+        scanCacheSeen[index] = now;
     }
-    if (record->phy_11n) {
-        strcat(phy_str, "/n");
+    
+    // Age out APs that haven't been seen for a while.
+    size_t kept = 0;
+    for (size_t i = 0; i < scanCacheCount; i++) {
+        if (now - scanCacheSeen[i] > (int64_t) WIFI_SCAN_CACHE_MAX_AGE_MS * 1000) continue;
+        if (kept != i) {
+            scanCache[kept]     = scanCache[i];
+            scanCacheSeen[kept] = scanCacheSeen[i];
+        }
+        kept++;
     }
-    phy_str[2] = '1';
+    scanCacheCount = kept;
     
-    ESP_LOGI(TAG, "AP %s %s rssi=%hhd%s", bssid_str, record->ssid, record->rssi, phy_str);
-    free(bssid_str);
-    free(phy_str);
+    // Sort strongest first, the cache is small and mostly sorted already.
+    for (size_t i = 1; i < scanCacheCount; i++) {
+        wifi_ap_record_t record = scanCache[i];
+        int64_t          seen   = scanCacheSeen[i];
+        size_t           j      = i;
+        for (; j > 0 && scanCache[j - 1].rssi < record.rssi; j--) {
+            scanCache[j]     = scanCache[j - 1];
+            scanCacheSeen[j] = scanCacheSeen[j - 1];
+        }
+        scanCache[j]     = record;
+        scanCacheSeen[j] = seen;
+    }
+    scanCacheTime = now;
 }
 
-// Scan for WiFi access points.
-size_t wifi_scan(wifi_ap_record_t **aps_out) {
-    isScanning = true;
-    wifi_ap_record_t *aps = NULL;
-    // Scan for any non-hidden APs on all channels.
-    wifi_scan_config_t cfg = {
-        .ssid    = NULL,
-        .bssid   = NULL,
-        .channel = 0,
-        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
-        .scan_time = { .active={ 0, 0 } },
-    };
+// Copies the scan cache into a newly allocated AP list.
+static size_t wifi_scan_cache_get(wifi_ap_record_t** aps_out) {
+    xSemaphoreTake(scanCacheMutex, portMAX_DELAY);
+    size_t num_ap = scanCacheCount;
+    if (aps_out) {
+        *aps_out = malloc(sizeof(wifi_ap_record_t) * (num_ap ? num_ap : 1));
+        if (!*aps_out) {
+            ESP_LOGE(TAG, "Out of memory (%zd bytes)", sizeof(wifi_ap_record_t) * num_ap);
+            num_ap = 0;
+        } else {
+            memcpy(*aps_out, scanCache, sizeof(wifi_ap_record_t) * num_ap);
+        }
+    }
+    xSemaphoreGive(scanCacheMutex);
+    return num_ap;
+}
+
+// Get direct access to the scan cache.
+size_t wifi_scan_get_results(const wifi_ap_record_t** aps) {
+    xSemaphoreTake(scanCacheMutex, portMAX_DELAY);
+    *aps = scanCache;
+    return scanCacheCount;
+}
+
+// Release access to the scan cache.
+void wifi_scan_release_results() {
+    xSemaphoreGive(scanCacheMutex);
+}
+
+// Whether the scan cache is recent enough to skip scanning.
+static bool wifi_scan_cache_fresh() {
+    return scanCacheTime && scanCacheTtl && esp_timer_get_time() - scanCacheTime < (int64_t) scanCacheTtl * 1000;
+}
+
+// Set how long scan results are reused by `wifi_scan`.
+void wifi_scan_set_cache_ttl(uint32_t ttl_ms) {
+    scanCacheTtl = ttl_ms;
+}
+
+// Forget all cached scan results.
+void wifi_scan_flush_cache() {
+    xSemaphoreTake(scanCacheMutex, portMAX_DELAY);
+    scanCacheCount = 0;
+    scanCacheTime  = 0;
+    xSemaphoreGive(scanCacheMutex);
+}
+
+// Fills in the scan config for a profile and returns the mask of channels to scan.
+static uint16_t wifi_scan_profile_config(wifi_scan_profile_t profile, wifi_scan_config_t* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->scan_type = WIFI_SCAN_TYPE_ACTIVE;
+    uint16_t channels = WIFI_SCAN_ALL_CHANNELS;
+    switch (profile) {
+        case WIFI_SCAN_PROFILE_FAST:
+            cfg->scan_time.active.min = WIFI_SCAN_FAST_DWELL_MS / 2;
+            cfg->scan_time.active.max = WIFI_SCAN_FAST_DWELL_MS;
+            // Only look where our networks were seen before, if we know that.
+            if (knownChannels) channels = knownChannels;
+            break;
+        case WIFI_SCAN_PROFILE_THOROUGH:
+            cfg->scan_time.active.min = WIFI_SCAN_THOROUGH_DWELL_MS / 2;
+            cfg->scan_time.active.max = WIFI_SCAN_THOROUGH_DWELL_MS;
+            cfg->show_hidden          = true;
+            break;
+        case WIFI_SCAN_PROFILE_PASSIVE:
+            cfg->scan_type         = WIFI_SCAN_TYPE_PASSIVE;
+            cfg->scan_time.passive = WIFI_SCAN_PASSIVE_DWELL_MS;
+            break;
+        default:
+            // Driver defaults.
+            break;
+    }
+    return channels;
+}
+
+// Returns the first channel in `channels` after `channel`, or 0 if there are none.
+static uint8_t wifi_scan_next_channel(uint16_t channels, uint8_t channel) {
+    for (channel++; channel <= WIFI_SCAN_MAX_CHANNEL; channel++) {
+        if (channels & (1 << channel)) return channel;
+    }
+    return 0;
+}
+
+// Fetches the results of a finished scan, logs them and merges them into the scan cache.
+static uint16_t wifi_scan_collect(wifi_ap_record_t* aps, uint16_t max_ap) {
+    uint16_t num_ap = max_ap;
+    // Records that don't fit are dropped and freed by the driver.
+    if (esp_wifi_scan_get_ap_records(&num_ap, aps) != ESP_OK) return 0;
+    for (uint16_t i = 0; i < num_ap; i++) {
+        wifi_desc_record(&aps[i]);
+    }
     
-    // Start the scan now.
-    ESP_LOGI(TAG, "Starting scan...");
-    esp_err_t res = esp_wifi_scan_start(&cfg, true);
-    // Whether to call esp_wifi_stop() on finish.
-    bool stopWhenDone = false;
-    if (res == ESP_ERR_WIFI_NOT_STARTED) {
-        // If it complains that the wifi wasn't started, then do so.
-        ESP_LOGI(TAG, "Starting WiFi for scan");
-        
-        // Set to station but don't connect.
-        res = esp_wifi_set_mode(WIFI_MODE_STA);
-        if (res) goto ohno;
-        
-        // Start WiFi.
-        res = esp_wifi_start();
-        if (res) goto ohno;
-        stopWhenDone = true;
-        
-        // Await the STA started bit.
-        xEventGroupWaitBits(wifiEventGroup, WIFI_STARTED_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(2000));
-        
-        // Try again.
-        res = esp_wifi_scan_start(&cfg, true);
+    xSemaphoreTake(scanCacheMutex, portMAX_DELAY);
+    wifi_scan_cache_merge(aps, num_ap);
+    xSemaphoreGive(scanCacheMutex);
+    return num_ap;
+}
+
+// Finishes an asynchronous scan.
+static void wifi_scan_async_finish() {
+    scanAsyncActive = false;
+    if (wifi_scan_release() && status.state == WIFI_STATE_CONNECTING) {
+        // A connection attempt waited for the scan.
+        wifi_connect_start();
+    } else if (scanAsyncStopWhenDone && (status.state == WIFI_STATE_IDLE || status.state == WIFI_STATE_FAILED)) {
+        // Stop WiFi because it was started only for this scan.
+        esp_wifi_stop();
+    }
+    uint32_t duration = (esp_timer_get_time() - scanAsyncStart) / 1000;
+    ESP_LOGI(TAG, "Scan finished in %u ms", duration);
+    wifi_publish_scan_done(duration);
+}
+
+// Starts scanning the next channel of an asynchronous scan.
+static esp_err_t wifi_scan_async_start_channel() {
+    scanAsyncChannel = wifi_scan_next_channel(scanAsyncChannels, scanAsyncChannel);
+    scanAsyncConfig.channel = scanAsyncChannel;
+    return esp_wifi_scan_start(&scanAsyncConfig, false);
+}
+
+// Gives up on an asynchronous scan that could not be started, without calling back.
+static void wifi_scan_async_abort(esp_err_t res) {
+    ESP_LOGE(TAG, "Error in WiFi scan: %s", esp_err_to_name(res));
+    scanAsyncActive = false;
+    if (wifi_scan_release()) {
+        // Run the connection attempt that waited for the scan.
+        esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_SCAN_END, NULL, 0, portMAX_DELAY);
     }
+}
+
+// Finishes an asynchronous scan before its last channel and reports it as done.
+static void wifi_scan_async_cut_short() {
+    wifi_scan_progress_t progress = {
+        .aps         = NULL,
+        .num_aps     = 0,
+        .channel     = scanAsyncChannel,
+        .done        = true,
+        .duration_us = esp_timer_get_time() - scanAsyncStart,
+    };
+    wifi_scan_async_finish();
+    scanAsyncCallback(&progress, scanAsyncCtx);
+}
+
+// Starts scanning the next channel of an asynchronous scan, called from the event loop task only.
+static void wifi_scan_async_next() {
+    esp_err_t res = wifi_scan_async_start_channel();
     if (res) {
-        ohno:
         ESP_LOGE(TAG, "Error in WiFi scan: %s", esp_err_to_name(res));
-        isScanning = false;
-        return 0;
+        wifi_scan_async_cut_short();
     }
+}
+
+// Collects the results of one channel of an asynchronous scan.
+static void wifi_scan_async_channel_done() {
+    uint16_t num_ap = wifi_scan_collect(scanPool, WIFI_SCAN_POOL_SIZE);
+    wifi_scan_progress_t progress = {
+        .aps         = scanPool,
+        .num_aps     = num_ap,
+        .channel     = scanAsyncChannel,
+        .done        = !wifi_scan_next_channel(scanAsyncChannels, scanAsyncChannel),
+        .duration_us = esp_timer_get_time() - scanAsyncStart,
+    };
+    if (progress.done) wifi_scan_async_finish();
+    scanAsyncCallback(&progress, scanAsyncCtx);
+    if (!progress.done) wifi_scan_async_next();
+}
+
+// Scan for WiFi networks one channel at a time using the given strategy.
+esp_err_t wifi_scan_async_with_profile(wifi_scan_profile_t profile, wifi_scan_cb_t callback, void* ctx) {
+    if (!callback) return ESP_ERR_INVALID_ARG;
+    if (!wifi_scan_claim()) return ESP_ERR_INVALID_STATE;
+    scanAsyncCallback     = callback;
+    scanAsyncCtx          = ctx;
+    scanAsyncChannels     = wifi_scan_profile_config(profile, &scanAsyncConfig);
+    scanAsyncChannel      = 0;
+    scanAsyncStopWhenDone = false;
+    scanAsyncStart        = esp_timer_get_time();
+    scanAsyncActive       = true;
     
-    // Allocate memory for AP list.
-    uint16_t num_ap = 0;
-    WIFI_SORT_ERRCHECK(esp_wifi_scan_get_ap_num(&num_ap));
-    aps = malloc(sizeof(wifi_ap_record_t) * num_ap);
-    if (!aps) {
-        ESP_LOGE(TAG, "Out of memory (%zd bytes)", sizeof(wifi_ap_record_t) * num_ap);
-        num_ap = 0;
-        esp_wifi_scan_get_ap_records(&num_ap, NULL);
-        return 0;
+    ESP_LOGI(TAG, "Starting asynchronous scan...");
+    // Keeps a connect from restarting the driver while the scan starts.
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
+    esp_err_t res;
+    if (xEventGroupGetBits(wifiEventGroup) & WIFI_STARTED_BIT) {
+        // Scan right away, the event handler calls back and starts further channels.
+        res = wifi_scan_async_start_channel();
+    } else {
+        // Set to station but don't connect, the scan starts on WIFI_EVENT_STA_START.
+        scanAsyncStopWhenDone = true;
+        res = esp_wifi_set_mode(WIFI_MODE_STA);
+        if (res == ESP_OK) res = esp_wifi_start();
     }
+    xSemaphoreGive(apiMutex);
+    if (res) wifi_scan_async_abort(res);
+    return res;
+}
+
+// Scan for WiFi networks one channel at a time.
+esp_err_t wifi_scan_async(wifi_scan_cb_t callback, void* ctx) {
+    return wifi_scan_async_with_profile(WIFI_SCAN_PROFILE_DEFAULT, callback, ctx);
+}
+
+// Scan for WiFi networks using the given strategy, bypassing the scan cache TTL.
+size_t wifi_scan_with_profile(wifi_scan_profile_t profile, wifi_ap_record_t **aps_out, uint32_t* duration_ms) {
+    if (!wifi_scan_claim()) return wifi_scan_cache_get(aps_out);
+    xSemaphoreTake(apiMutex, portMAX_DELAY);
     
-    // Collect APs and report findings.
-    WIFI_SORT_ERRCHECK(esp_wifi_scan_get_ap_records(&num_ap, aps));
-    for (uint16_t i = 0; i < num_ap; i++) {
-        wifi_desc_record(&aps[i]);
-    }
+    wifi_scan_config_t cfg;
+    uint16_t channels = wifi_scan_profile_config(profile, &cfg);
+    // Scan all channels in one go if possible, otherwise one by one.
+    uint8_t  channel  = channels == WIFI_SCAN_ALL_CHANNELS ? 0 : wifi_scan_next_channel(channels, 0);
+    int64_t  start    = esp_timer_get_time();
+    // Whether to call esp_wifi_stop() on finish.
+    bool     stopWhenDone = false;
+    
+    ESP_LOGI(TAG, "Starting scan...");
+    esp_err_t res;
+    do {
+        cfg.channel = channel;
+        res = esp_wifi_scan_start(&cfg, true);
+        if (res == ESP_ERR_WIFI_NOT_STARTED && !stopWhenDone) {
+            // If it complains that the wifi wasn't started, then do so.
+            ESP_LOGI(TAG, "Starting WiFi for scan");
+            
+            // Set to station but don't connect.
+            res = esp_wifi_set_mode(WIFI_MODE_STA);
+            if (res) break;
+            
+            // Start WiFi.
+            res = esp_wifi_start();
+            if (res) break;
+            stopWhenDone = true;
+            
+            // Await the STA started bit.
+            xEventGroupWaitBits(wifiEventGroup, WIFI_STARTED_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(2000));
+            
+            // Try again.
+            res = esp_wifi_scan_start(&cfg, true);
+        }
+        if (res) break;
+        
+        // Collect APs and report findings.
+        uint16_t num_ap = 0;
+        esp_wifi_scan_get_ap_num(&num_ap);
+        if (num_ap > WIFI_SCAN_POOL_SIZE) ESP_LOGW(TAG, "Found %d APs, keeping %d", num_ap, WIFI_SCAN_POOL_SIZE);
+        wifi_scan_collect(scanPool, WIFI_SCAN_POOL_SIZE);
+    } while (channel && (channel = wifi_scan_next_channel(channels, channel)));
     
     // Clean up.
-    if (aps_out) {
-        // Output pointer is non-null, return the APs list.
-        *aps_out = aps;
-    } else {
-        // Output pointer is null, free the APs list.
-        free(aps);
-    }
     if (stopWhenDone) {
         // Stop WiFi because it was started only for this scan.
         esp_wifi_stop();
     }
-    isScanning = false;
-    return num_ap;
+    xSemaphoreGive(apiMutex);
+    if (wifi_scan_release()) {
+        // Run the connection attempt that waited for the scan.
+        esp_event_post(WIFI_CONNECTION_CMD, WIFI_CMD_SCAN_END, NULL, 0, portMAX_DELAY);
+    }
     
-    error:
-    if (aps) free(aps);
-    return 0;
+    uint32_t duration = (esp_timer_get_time() - start) / 1000;
+    if (duration_ms) *duration_ms = duration;
+    if (res) {
+        ESP_LOGE(TAG, "Error in WiFi scan: %s", esp_err_to_name(res));
+        return 0;
+    }
+    ESP_LOGI(TAG, "Scan finished in %u ms", duration);
+    wifi_publish_scan_done(duration);
+    
+    // Return the merged list.
+    return wifi_scan_cache_get(aps_out);
+}
+
+// Scan for WiFi access points.
+size_t wifi_scan(wifi_ap_record_t **aps_out) {
+    if (wifi_scan_cache_fresh()) {
+        // Recent enough, don't bother the radio.
+        return wifi_scan_cache_get(aps_out);
+    }
+    return wifi_scan_with_profile(WIFI_SCAN_PROFILE_DEFAULT, aps_out, NULL);
+}
+
+// Mark a channel as used by one of our networks.
+void wifi_scan_add_known_channel(uint8_t channel) {
+    if (channel < 1 || channel > WIFI_SCAN_MAX_CHANNEL) return;
+    knownChannels |= 1 << channel;
 }
 
 // Get the strength value for a given RSSI.
@@ -0,0 +1,183 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "ping/ping_sock.h"
+
+#include "wifi_connection.h"
+#include "wifi_health.h"
+#include "bsp_tasks.h"
+
+static const char *TAG = "wifi_health";
+
+static wifi_health_config_t healthConfig = {
+    .interval_ms  = WIFI_HEALTH_INTERVAL_MS,
+    .timeout_ms   = WIFI_HEALTH_TIMEOUT_MS,
+    .max_failures = WIFI_HEALTH_MAX_FAILURES,
+};
+static bool                healthRunning  = false;
+static SemaphoreHandle_t   healthMutex    = NULL;   // Guards the ping session.
+static esp_ping_handle_t   healthPing     = NULL;   // Ping session of the current connection.
+static bool                healthAnswered = false;  // Whether the gateway answered since connecting.
+static wifi_health_stats_t healthStats    = {0};
+static portMUX_TYPE        healthLock     = portMUX_INITIALIZER_UNLOCKED;  // Guards the stats.
+
+// Histogram bucket of an RTT.
+static size_t wifi_health_bucket(uint32_t rtt_ms) {
+    size_t bucket = 0;
+    while (bucket < WIFI_HEALTH_RTT_BUCKETS - 1 && rtt_ms >= (2u << bucket)) bucket++;
+    return bucket;
+}
+
+// Records a reply, called from the ping task.
+static void wifi_health_success(esp_ping_handle_t ping, void* arg) {
+    uint32_t rtt_ms = 0;
+    esp_ping_get_profile(ping, ESP_PING_PROF_TIMEGAP, &rtt_ms, sizeof(rtt_ms));
+    portENTER_CRITICAL(&healthLock);
+    if (healthStats.probes == healthStats.lost || rtt_ms < healthStats.min_rtt_ms) healthStats.min_rtt_ms = rtt_ms;
+    if (rtt_ms > healthStats.max_rtt_ms) healthStats.max_rtt_ms = rtt_ms;
+    healthStats.probes++;
+    healthStats.last_rtt_ms      = rtt_ms;
+    healthStats.consecutive_lost = 0;
+    healthStats.rtt_histogram[wifi_health_bucket(rtt_ms)]++;
+    healthAnswered = true;
+    portEXIT_CRITICAL(&healthLock);
+}
+
+// Records a lost probe and reconnects if the link seems dead, called from the ping task.
+static void wifi_health_timeout(esp_ping_handle_t ping, void* arg) {
+    portENTER_CRITICAL(&healthLock);
+    healthStats.probes++;
+    healthStats.lost++;
+    if (healthStats.consecutive_lost < UINT8_MAX) healthStats.consecutive_lost++;
+    bool dead = healthAnswered && healthStats.consecutive_lost >= healthConfig.max_failures;
+    if (dead) {
+        healthStats.reconnects++;
+        healthAnswered = false;
+    }
+    uint8_t lost = healthStats.consecutive_lost;
+    portEXIT_CRITICAL(&healthLock);
+    
+    if (dead) {
+        // The connection state machine reconnects after the disconnect.
+        ESP_LOGW(TAG, "Gateway did not answer %d probes, reconnecting", lost);
+        esp_wifi_disconnect();
+    }
+}
+
+// Stops probing. Must be called with the health mutex held.
+static void wifi_health_end_session() {
+    if (!healthPing) return;
+    esp_ping_stop(healthPing);
+    esp_ping_delete_session(healthPing);
+    healthPing = NULL;
+}
+
+// Starts probing the gateway of the current connection. Must be called with the health mutex held.
+static void wifi_health_begin_session(const esp_netif_ip_info_t* ip_info) {
+    wifi_health_end_session();
+    if (!ip_info->gw.addr) return;
+    
+    esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+    ip_addr_t target = IPADDR4_INIT(ip_info->gw.addr);
+    config.target_addr = target;
+    config.count       = ESP_PING_COUNT_INFINITE;
+    config.interval_ms = healthConfig.interval_ms;
+    config.timeout_ms  = healthConfig.timeout_ms;
+    config.data_size   = 0;
+    const bsp_task_config_t* task = bsp_task_get_config(BSP_TASK_WIFI_HEALTH);
+    config.task_prio       = task->priority;
+    config.task_stack_size = task->stack_size;
+    
+    portENTER_CRITICAL(&healthLock);
+    healthAnswered               = false;
+    healthStats.consecutive_lost = 0;
+    portEXIT_CRITICAL(&healthLock);
+    // The ping session runs in a task created by esp_ping_new_session with the placement above.
+    esp_ping_callbacks_t callbacks = {
+        .on_ping_success = wifi_health_success,
+        .on_ping_timeout = wifi_health_timeout,
+    };
+    esp_err_t res = esp_ping_new_session(&config, &callbacks, &healthPing);
+    if (res == ESP_OK) res = esp_ping_start(healthPing);
+    if (res) {
+        ESP_LOGE(TAG, "Failed to start probing: %s", esp_err_to_name(res));
+        wifi_health_end_session();
+    }
+}
+
+// Follows the connection, called from the dispatcher task.
+static void wifi_health_event(const wifi_connection_event_t* event, void* ctx) {
+    if (event->id != WIFI_CONNECTION_EVENT_CONNECTED && event->id != WIFI_CONNECTION_EVENT_DISCONNECTED) return;
+    xSemaphoreTake(healthMutex, portMAX_DELAY);
+    if (!healthRunning) {
+        // Stopped while this event was on its way.
+    } else if (event->id == WIFI_CONNECTION_EVENT_CONNECTED) {
+        wifi_health_begin_session(&event->ip_info);
+    } else {
+        wifi_health_end_session();
+    }
+    xSemaphoreGive(healthMutex);
+}
+
+// Start the connectivity watchdog.
+esp_err_t wifi_health_start(const wifi_health_config_t* config) {
+    if (config && (!config->interval_ms || !config->timeout_ms || !config->max_failures)) return ESP_ERR_INVALID_ARG;
+    if (!healthMutex) {
+        healthMutex = xSemaphoreCreateMutex();
+        if (!healthMutex) return ESP_ERR_NO_MEM;
+    }
+    
+    xSemaphoreTake(healthMutex, portMAX_DELAY);
+    esp_err_t res = ESP_OK;
+    if (config) {
+        portENTER_CRITICAL(&healthLock);
+        healthConfig = *config;
+        portEXIT_CRITICAL(&healthLock);
+    }
+    if (!healthRunning) {
+        res = wifi_subscribe(wifi_health_event, NULL);
+        healthRunning = res == ESP_OK;
+    }
+    if (healthRunning) {
+        // Start probing right away if already connected, or apply the new settings.
+        wifi_connection_status_t status;
+        wifi_get_status(&status);
+        if (status.state == WIFI_STATE_CONNECTED) wifi_health_begin_session(&status.ip_info);
+    }
+    xSemaphoreGive(healthMutex);
+    return res;
+}
+
+// Stop the connectivity watchdog.
+void wifi_health_stop() {
+    if (!healthMutex) return;
+    xSemaphoreTake(healthMutex, portMAX_DELAY);
+    if (healthRunning) wifi_unsubscribe(wifi_health_event, NULL);
+    healthRunning = false;
+    wifi_health_end_session();
+    xSemaphoreGive(healthMutex);
+}
+
+// Whether the gateway answers.
+bool wifi_health_ok() {
+    portENTER_CRITICAL(&healthLock);
+    bool ok = !healthStats.consecutive_lost;
+    portEXIT_CRITICAL(&healthLock);
+    return ok;
+}
+
+// Get the probe results and RTT histogram.
+void wifi_health_get_stats(wifi_health_stats_t* stats) {
+    portENTER_CRITICAL(&healthLock);
+    *stats = healthStats;
+    portEXIT_CRITICAL(&healthLock);
+}
+
+// Reset the probe results and RTT histogram.
+void wifi_health_reset_stats() {
+    portENTER_CRITICAL(&healthLock);
+    memset(&healthStats, 0, sizeof(healthStats));
+    portEXIT_CRITICAL(&healthLock);
+}